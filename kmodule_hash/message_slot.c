@@ -6,84 +6,67 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/fs.h>        /* For register_chrdev */
-#include <linux/string.h>    /* For memset */
-#include <linux/slab.h>      /* For slab allocation */
-#include <linux/hashtable.h> /* For the hashtable */
-#include <linux/list.h>      /* For the list */
+#include <linux/uaccess.h>   /* For copy_from_user */
+#include <linux/uio.h>       /* For iov_iter */
+#include <linux/mm.h>        /* For remap_vmalloc_range */
+#include <linux/poll.h>      /* For poll */
+#include <linux/sched/signal.h> /* For fatal_signal_pending */
+#include <linux/debugfs.h>   /* For the statistics */
+#include <linux/seq_file.h>
+#include <linux/moduleparam.h>
+#include <linux/workqueue.h> /* For the reclaimer */
+#include <linux/capability.h> /* For raising a quota */
 
 MODULE_LICENSE("GPL");
 
-/* For IOCTL operations */
-#include "message_slot.h"
+/* For IOCTL operations, and the slots, channels and messages */
+#include "msg_store.h"
 
-#define HASHTABLE_BITS 20
-static DEFINE_HASHTABLE(channel_htable, HASHTABLE_BITS);
+/* Batch entries copied in at once, on the stack */
+#define BATCH_CHUNK 16
 
-struct channel
-{
-        unsigned char slot_id;
-        unsigned int channel_id;
-        size_t message_length;
-        char message[MSG_MAX_LEN];
-        struct hlist_node channel_hnode;
-};
+/* How often the reclaimer evicts idle channels, and keeps to store_cap */
+#define RECLAIM_INTERVAL HZ
 
-/*
- * This should be randomly generated per module load for an adversary
- * resistant hash table using crypto modules.
- */
+static struct dentry *debugfs_dir;
 
-#define RANDOM_PEPPER 123456789
+module_param(slot_quota, ulong, 0644);
+MODULE_PARM_DESC(slot_quota, "Bytes of messages a slot may hold, 0 for no limit, by default (1 MiB)");
+module_param(store_cap, ulong, 0644);
+MODULE_PARM_DESC(store_cap, "Bytes of channels, messages and rings all slots may hold, 0 for no limit (default)");
+module_param(idle_timeout, uint, 0644);
+MODULE_PARM_DESC(idle_timeout, "Seconds after which a channel no one uses is evicted, 0 for never (default)");
+
+static void reclaim(struct work_struct *work);
+static DECLARE_DELAYED_WORK(reclaim_work, reclaim);
 
 /*
- * A channel can be uniquely described as its slot_id
- * concatenated with its channel_id
+ * What an open file of a slot reads and writes, as its private_data
  */
-static long calc_key(unsigned char slot_id, unsigned int channel_id)
-{
-        long key = slot_id;
-        key <<= sizeof(unsigned int);
-        key |= channel_id;
-        return key ^ RANDOM_PEPPER;
-}
-
-static long channel_key(struct channel *ch)
-{
-        return calc_key(ch->slot_id, ch->channel_id);
-}
-
-static struct channel *find_channel(unsigned char slot_id, unsigned int channel_id)
-{
-        struct channel *channel_cursor;
-        long key = calc_key(slot_id, channel_id);
-        hash_for_each_possible(channel_htable, channel_cursor, channel_hnode, key) if (channel_cursor->slot_id == slot_id && channel_cursor->channel_id == channel_id) return channel_cursor;
-        return NULL;
-}
-
-static LIST_HEAD(slot_llist);
-
-struct slot
+struct slot_file
 {
-        unsigned int minor;
-        struct list_head slot_lhead;
+        struct slot *slot;
+        unsigned int channel_id; /* 0 until set with MSG_SLOT_CHANNEL */
+        unsigned long flags;     /* MSG_SLOT_BLOCKING */
+        u64 last_seq;            /* Of the last message read, 0 for none */
 };
 
-static struct slot *find_slot(unsigned int minor)
-{
-        struct slot *slot_cursor;
-        list_for_each_entry(slot_cursor, &slot_llist, slot_lhead) if (slot_cursor->minor == minor) return slot_cursor;
-        return NULL;
-}
-
-static int new_slot(unsigned char minor)
+/*
+ * Returns the channel the file is set to with a reference taken, created if
+ * it does not exist yet and create is set, or NULL if it does not, or an
+ * ERR_PTR
+ */
+static struct channel *file_channel(struct file *file, bool create)
 {
-        struct slot *slot;
-        slot = kmalloc(sizeof(struct slot), GFP_KERNEL);
-        if (slot == NULL)
-                return -ENOMEM;
-        slot->minor = minor;
-        list_add(&slot->slot_lhead, &slot_llist);
-        return SUCCESS;
+        struct slot_file *slot_file = file->private_data;
+        unsigned int channel_id = READ_ONCE(slot_file->channel_id);
+        struct channel *channel;
+        if (channel_id == 0)
+                return ERR_PTR(-EINVAL);
+        channel = find_channel(slot_file->slot, channel_id);
+        if (channel == NULL && create)
+                channel = new_channel(slot_file->slot, channel_id);
+        return channel;
 }
 
 static int device_open(struct inode *inode,
@@ -91,6 +74,7 @@ static int device_open(struct inode *inode,
 {
         int new_status;
         unsigned char minor;
+        struct slot_file *slot_file;
         if (inode == NULL || file == NULL)
                 return -EINVAL;
         minor = (unsigned char)iminor(inode);
@@ -99,8 +83,12 @@ static int device_open(struct inode *inode,
                 new_status = new_slot(minor);
                 if (new_status)
                         return new_status;
-                file->private_data = (void *)0;
         }
+        slot_file = kzalloc(sizeof(struct slot_file), GFP_KERNEL);
+        if (slot_file == NULL)
+                return -ENOMEM;
+        slot_file->slot = find_slot(minor);
+        file->private_data = slot_file;
         return SUCCESS;
 }
 
@@ -109,115 +97,324 @@ static int device_release(struct inode *inode,
 {
         if (inode == NULL || file == NULL)
                 return -EINVAL;
+        kfree(file->private_data);
         return SUCCESS;
 }
 
-static ssize_t device_read(struct file *file,
-                           char __user *buffer,
-                           size_t length,
-                           loff_t *offset)
+/*
+ * Whether a read or write may not sleep: O_NONBLOCK, or IOCB_NOWAIT from
+ * io_uring or preadv2 with RWF_NOWAIT
+ */
+static bool nonblocking(struct kiocb *iocb)
 {
-        unsigned char minor;
-        unsigned int channel_id;
-        size_t message_length;
+        return (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+}
+
+/*
+ * read, readv, io_uring and splice all come here, and copy the message
+ * straight into the segments of the iov_iter. Those may add up to more than
+ * MSG_MAX_LEN, as a splice's pipe does: only the message is copied.
+ */
+static ssize_t device_read_iter(struct kiocb *iocb,
+                                struct iov_iter *to)
+{
+        struct file *file = iocb->ki_filp;
+        int rc;
         ssize_t bytes_read;
-        struct slot *slot;
+        bool blocking;
+        struct slot_file *slot_file;
         struct channel *channel;
-        if (file == NULL || buffer == NULL || length > MSG_MAX_LEN)
-                return -EINVAL;
-        channel_id = (unsigned long)file->private_data;
-        if (channel_id == 0)
-                return -EINVAL;
-        minor = (unsigned char)iminor(file_inode(file));
-        slot = find_slot(minor);
-        if (slot == NULL)
-                return -EINVAL;
-        channel = find_channel(minor, channel_id);
+        slot_file = file->private_data;
+        blocking = (READ_ONCE(slot_file->flags) & MSG_SLOT_BLOCKING) && !nonblocking(iocb);
+        /* A blocking read waits on the channel, which has to exist for that */
+        channel = file_channel(file, blocking);
+        if (IS_ERR(channel))
+                return PTR_ERR(channel);
         if (channel == NULL)
-                return -EWOULDBLOCK;
-        message_length = channel->message_length;
-        if (message_length == 0)
-                return -EWOULDBLOCK;
-        if (message_length > length)
-                return -ENOSPC;
-        bytes_read = simple_read_from_buffer(buffer, length, offset, channel->message, message_length);
-        if (bytes_read >= 0 && (size_t)bytes_read != message_length)
-                return -EIO;
+                return count_result(-EWOULDBLOCK, false);
+        while (true)
+        {
+                if (blocking)
+                { /* For a message this file has not read yet */
+                        rc = wait_event_interruptible(channel->waitq, has_new_message(channel, slot_file->last_seq));
+                        if (rc)
+                        {
+                                bytes_read = rc;
+                                break;
+                        }
+                }
+                bytes_read = read_message(slot_file->slot, channel, to, &slot_file->last_seq);
+                /* Another reader may have emptied the queue first */
+                if (bytes_read != -EWOULDBLOCK || !blocking)
+                        break;
+        }
+        put_channel(channel);
         return bytes_read;
 }
 
-static ssize_t device_write(struct file *file,
-                            const char __user *buffer,
-                            size_t length,
-                            loff_t *offset)
+/*
+ * The segments of the iov_iter make up one message, which readers see all of
+ * or none of. A splice's are all it takes from the pipe at once, up to the
+ * length spliced, so that is one message too, and more than MSG_MAX_LEN of
+ * them fails.
+ */
+static ssize_t device_write_iter(struct kiocb *iocb,
+                                 struct iov_iter *from)
 {
-        unsigned char minor;
-        unsigned int channel_id;
-        ssize_t bytes_wrote;
-        char buffer_for_atomic_write[MSG_MAX_LEN];
-        struct slot *slot;
+        struct file *file = iocb->ki_filp;
+        ssize_t bytes_written;
+        struct slot_file *slot_file;
         struct channel *channel;
-        if (file == NULL || buffer == NULL || length > MSG_MAX_LEN)
-                return -EINVAL;
-        channel_id = (unsigned long)file->private_data;
-        if (channel_id == 0)
+        if (iov_iter_count(from) > MSG_MAX_LEN)
                 return -EINVAL;
-        minor = (unsigned char)iminor(file_inode(file));
-        slot = find_slot(minor);
-        if (slot == NULL)
-                return -EINVAL;
-        channel = find_channel(minor, channel_id);
-        if (channel == NULL)
-        { /* If this channel doesn't exist, then create it */
-                channel = (struct channel *)kmalloc(sizeof(struct channel), GFP_KERNEL);
-                if (channel == NULL)
-                        return -ENOMEM;
-                channel->slot_id = minor;
-                channel->channel_id = channel_id;
-                hash_add(channel_htable, &channel->channel_hnode, channel_key(channel));
+        slot_file = file->private_data;
+        /* If this channel doesn't exist, then create it */
+        channel = file_channel(file, true);
+        if (IS_ERR(channel))
+                return PTR_ERR(channel);
+        bytes_written = write_message(slot_file->slot, channel, from, nonblocking(iocb));
+        put_channel(channel);
+        return bytes_written;
+}
+
+/*
+ * Handles MSG_SLOT_READ_BATCH and MSG_SLOT_WRITE_BATCH, copying the entries
+ * in and their statuses back out BATCH_CHUNK at a time. Returns 0 once every
+ * entry has its status, however they went.
+ */
+static long device_batch(struct file *file,
+                         unsigned long ioctl_param,
+                         bool write)
+{
+        struct slot_file *slot_file = file->private_data;
+        struct msg_slot_batch batch;
+        struct msg_slot_batch_entry entries[BATCH_CHUNK];
+        struct msg_slot_batch_entry __user *user_entries;
+        unsigned int done, n, i;
+        if (copy_from_user(&batch, (void __user *)ioctl_param, sizeof(batch)))
+                return -EFAULT;
+        user_entries = u64_to_user_ptr(batch.entries);
+        for (done = 0; done < batch.count; done += n)
+        {
+                n = min_t(unsigned int, batch.count - done, BATCH_CHUNK);
+                if (copy_from_user(entries, user_entries + done, n * sizeof(entries[0])))
+                        return -EFAULT;
+                for (i = 0; i < n; ++i)
+                        entries[i].status = batch_entry(slot_file->slot, &entries[i], write);
+                if (copy_to_user(user_entries + done, entries, n * sizeof(entries[0])))
+                        return -EFAULT;
+                if (fatal_signal_pending(current))
+                        return -EINTR;
+                cond_resched();
         }
-        bytes_wrote = simple_write_to_buffer(buffer_for_atomic_write, MSG_MAX_LEN, offset, buffer, length);
-        if (bytes_wrote >= 0 && (size_t)bytes_wrote != length)
-                return -EIO;
-        strncpy(channel->message, buffer_for_atomic_write, length);
-        channel->message_length = length;
-        return bytes_wrote;
+        return SUCCESS;
 }
 
 static long device_ioctl(struct file *file,
                          unsigned int ioctl_command_id,
                          unsigned long ioctl_param)
 {
-        unsigned int channel_id;
-        unsigned char minor;
-        if (file == NULL || ioctl_command_id != MSG_SLOT_CHANNEL || ioctl_param == 0)
+        struct slot_file *slot_file;
+        struct channel *channel;
+        struct msg_slot_queue queue;
+        unsigned long quota;
+        int rc;
+        if (file == NULL)
+                return -EINVAL;
+        slot_file = file->private_data;
+        switch (ioctl_command_id)
+        {
+        case MSG_SLOT_CHANNEL:
+                if (ioctl_param == 0 || ioctl_param > UINT_MAX)
+                        return -EINVAL;
+                WRITE_ONCE(slot_file->channel_id, (unsigned int)ioctl_param);
+                slot_file->last_seq = 0;
+                return SUCCESS;
+        case MSG_SLOT_QUOTA:
+                /* Anyone who can open the slot may lower its quota, but not lift it */
+                quota = READ_ONCE(slot_file->slot->quota);
+                if ((ioctl_param == 0 || (quota != 0 && ioctl_param > quota)) &&
+                    !capable(CAP_SYS_RESOURCE))
+                        return -EPERM;
+                WRITE_ONCE(slot_file->slot->quota, ioctl_param);
+                return SUCCESS;
+        case MSG_SLOT_FLAGS:
+                if (ioctl_param & ~(unsigned long)MSG_SLOT_BLOCKING)
+                        return -EINVAL;
+                WRITE_ONCE(slot_file->flags, ioctl_param);
+                return SUCCESS;
+        case MSG_SLOT_RING_WAKE:
+                channel = file_channel(file, false);
+                if (IS_ERR(channel))
+                        return PTR_ERR(channel);
+                if (channel != NULL)
+                {
+                        wake_up_interruptible_all(&channel->waitq);
+                        put_channel(channel);
+                }
+                return SUCCESS;
+        case MSG_SLOT_QUEUE:
+                if (copy_from_user(&queue, (void __user *)ioctl_param, sizeof(queue)))
+                        return -EFAULT;
+                channel = file_channel(file, true);
+                if (IS_ERR(channel))
+                        return PTR_ERR(channel);
+                rc = set_queue(slot_file->slot, channel, queue.depth, queue.policy);
+                put_channel(channel);
+                return rc;
+        case MSG_SLOT_READ_BATCH:
+                return device_batch(file, ioctl_param, false);
+        case MSG_SLOT_WRITE_BATCH:
+                return device_batch(file, ioctl_param, true);
+        default:
+                return -EINVAL;
+        }
+}
+
+/*
+ * Readable when the channel has a message this file has not read yet, which
+ * is when a blocking read would not block, or records in its ring, and
+ * writable unless its queue is full
+ */
+static __poll_t device_poll(struct file *file,
+                            poll_table *wait)
+{
+        struct slot_file *slot_file = file->private_data;
+        struct channel *channel;
+        __poll_t mask = 0;
+        channel = file_channel(file, true);
+        if (IS_ERR(channel))
+                return EPOLLERR;
+        poll_wait(file, &channel->waitq, wait);
+        poll_wait(file, &channel->writers_waitq, wait);
+        /* In queued mode, only while the queue has room */
+        if (READ_ONCE(channel->queue) == NULL || READ_ONCE(channel->queue_len) < READ_ONCE(channel->queue_depth))
+                mask |= EPOLLOUT | EPOLLWRNORM;
+        if (has_new_message(channel, slot_file->last_seq) || ring_has_records(channel))
+                mask |= EPOLLIN | EPOLLRDNORM;
+        put_channel(channel);
+        return mask;
+}
+
+/*
+ * Maps the channel's ring, see struct msg_slot_ring
+ */
+/*
+ * Each mapping of a ring holds a reference to its channel, so that the
+ * channel and its ring stay until the last mapping goes away
+ */
+static void ring_vm_open(struct vm_area_struct *vma)
+{
+        struct channel *channel = vma->vm_private_data;
+        refcount_inc(&channel->refs);
+}
+
+static void ring_vm_close(struct vm_area_struct *vma)
+{
+        put_channel(vma->vm_private_data);
+}
+
+static const struct vm_operations_struct ring_vm_ops =
+    {
+        .open = ring_vm_open,
+        .close = ring_vm_close};
+
+static int device_mmap(struct file *file,
+                       struct vm_area_struct *vma)
+{
+        struct slot_file *slot_file = file->private_data;
+        unsigned long size = vma->vm_end - vma->vm_start;
+        struct channel *channel;
+        struct msg_slot_ring *ring;
+        int rc;
+        if (vma->vm_pgoff != 0 || size <= PAGE_SIZE)
+                return -EINVAL;
+        size -= PAGE_SIZE;
+        if (!is_power_of_2(size / PAGE_SIZE) || size > MSG_RING_MAX_SIZE)
                 return -EINVAL;
-        channel_id = (unsigned int)ioctl_param;
-        minor = (unsigned char)iminor(file_inode(file));
-        file->private_data = (void *)ioctl_param;
+        channel = file_channel(file, true);
+        if (IS_ERR(channel))
+                return PTR_ERR(channel);
+        ring = channel_ring(slot_file->slot, channel, size);
+        rc = IS_ERR(ring) ? PTR_ERR(ring) : remap_vmalloc_range(vma, ring, 0);
+        if (rc)
+        {
+                put_channel(channel);
+                return rc;
+        }
+        /* The mapping keeps our reference */
+        vma->vm_ops = &ring_vm_ops;
+        vma->vm_private_data = channel;
         return SUCCESS;
 }
 
 static struct file_operations Fops =
     {
-        .read = device_read,
-        .write = device_write,
+        .read_iter = device_read_iter,
+        .write_iter = device_write_iter,
+        .splice_read = copy_splice_read,
+        .splice_write = iter_file_splice_write,
         .open = device_open,
         .unlocked_ioctl = device_ioctl,
+        .poll = device_poll,
+        .mmap = device_mmap,
         .release = device_release,
         .owner = THIS_MODULE};
 
+static int stats_show(struct seq_file *file, void *unused)
+{
+        static const char *const names[] = {"reads", "writes", "bytes_read", "bytes_written", "wouldblock", "nospc",
+                                            "lookups", "lookup_misses", "channels_created",
+                                            "evicted_idle", "evicted_lru"};
+        struct msg_stats total;
+        const u64 *values = (const u64 *)&total;
+        unsigned int i, minor;
+        struct slot *slot;
+        msg_store_stats(&total);
+        for (i = 0; i < ARRAY_SIZE(names); ++i)
+                seq_printf(file, "%s %llu\n", names[i], values[i]);
+        seq_printf(file, "bytes %ld\ncap %lu\n", msg_store_bytes(), READ_ONCE(store_cap));
+        seq_puts(file, "message sizes:\n");
+        seq_printf(file, "0 %llu\n", total.sizes[0]);
+        for (i = 1; i < STATS_SIZE_BUCKETS; ++i)
+                seq_printf(file, "%u-%u %llu\n", 1U << (i - 1), (1U << i) - 1, total.sizes[i]);
+        seq_puts(file, "slots: minor channels bytes quota\n");
+        for (minor = 0; minor < SLOTS_NUM; ++minor)
+        {
+                slot = find_slot(minor);
+                if (slot != NULL)
+                        seq_printf(file, "%u %d %ld %lu\n", minor, atomic_read(&slot->channels_num),
+                                   atomic_long_read(&slot->bytes_used), READ_ONCE(slot->quota));
+        }
+        return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats);
+
+static void reclaim(struct work_struct *work)
+{
+        msg_store_reclaim();
+        schedule_delayed_work(&reclaim_work, RECLAIM_INTERVAL);
+}
+
 /*  Register the char device */
 static int __init simple_init(void)
 {
         int rc;
+        rc = msg_store_init();
+        if (rc)
+                return rc;
         rc = register_chrdev(MAJOR_NUM, CHAR_DEV_NAME, &Fops);
         if (rc < 0)
         {
                 printk(KERN_ALERT "%s registraion failed for  %d\n",
                        DEVICE_FILE_NAME, MAJOR_NUM);
+                msg_store_exit();
                 return rc;
         }
+        /* Without debugfs, there are just no statistics to read */
+        debugfs_dir = debugfs_create_dir(DEVICE_FILE_NAME, NULL);
+        debugfs_create_file("stats", 0444, debugfs_dir, NULL, &stats_fops);
+        schedule_delayed_work(&reclaim_work, RECLAIM_INTERVAL);
         printk("Registeration successful.");
         printk("mknod /dev/%s c %d 0\n", DEVICE_FILE_NAME, MAJOR_NUM);
         return 0;
@@ -225,16 +422,10 @@ static int __init simple_init(void)
 
 static void __exit simple_cleanup(void)
 {
-        int bkt;
-        struct hlist_node *tmp;
-        struct slot *slot_cursor;
-        struct slot *slot_tmp;
-        struct channel *channel_cursor;
-        list_for_each_entry_safe(slot_cursor, slot_tmp, &slot_llist, slot_lhead)
-            kfree(slot_cursor);
-        hash_for_each_safe(channel_htable, bkt, tmp, channel_cursor, channel_hnode)
-            kfree(channel_cursor);
+        debugfs_remove_recursive(debugfs_dir);
         unregister_chrdev(MAJOR_NUM, CHAR_DEV_NAME);
+        cancel_delayed_work_sync(&reclaim_work);
+        msg_store_exit();
 }
 
 module_init(simple_init);
@@ -7,11 +7,191 @@
 
 /* Set the message of the device driver */
 #define MSG_SLOT_CHANNEL _IOW(MAJOR_NUM, 0, unsigned long)
-#define MSG_MAX_LEN 128
+/* Set how many bytes of messages the slot may hold, 0 for no limit; raising
+ * it, or setting it to 0, takes CAP_SYS_RESOURCE */
+#define MSG_SLOT_QUOTA _IOW(MAJOR_NUM, 1, unsigned long)
+/* Set the MSG_SLOT_* flags of the file */
+#define MSG_SLOT_FLAGS _IOW(MAJOR_NUM, 2, unsigned long)
+/* Reads wait for a message the file has not read yet, unless O_NONBLOCK */
+#define MSG_SLOT_BLOCKING 0x1
+/* Wake up the readers of the file's channel, after a push to its ring */
+#define MSG_SLOT_RING_WAKE _IO(MAJOR_NUM, 3)
+/* Read or write the channels of many entries, see struct msg_slot_batch */
+#define MSG_SLOT_READ_BATCH _IOW(MAJOR_NUM, 4, struct msg_slot_batch)
+#define MSG_SLOT_WRITE_BATCH _IOW(MAJOR_NUM, 5, struct msg_slot_batch)
+/* Set the file's channel to queued mode, see struct msg_slot_queue */
+#define MSG_SLOT_QUEUE _IOW(MAJOR_NUM, 6, struct msg_slot_queue)
+#define MSG_MAX_LEN (4 * 4096)
 #define CHAR_DEV_NAME "msgslot_char_dev"
 #define DEVICE_FILE_NAME "msgslot"
 
 #define SUCCESS 0
 
+/*
+ * An entry of a batch: its channel is read or written as if the file were
+ * set to it, except that a read never blocks, and status is set to what the
+ * read or write would return, or -errno. The batch ioctls return 0 once all
+ * the entries have their status, even if some failed.
+ */
+struct msg_slot_batch_entry
+{
+        unsigned long long buffer; /* The message, or where to read it to */
+        long long status;
+        unsigned int channel_id;
+        unsigned int length; /* Of the message, or of where to read it to */
+};
+
+struct msg_slot_batch
+{
+        unsigned long long entries; /* struct msg_slot_batch_entry * */
+        unsigned int count;
+        unsigned int pad;
+};
+
+/*
+ * In queued mode, a channel keeps up to depth messages in order, and each
+ * read takes the oldest one. A write to a full queue waits for room (unless
+ * O_NONBLOCK, and then fails with EAGAIN), drops the oldest message, or fails
+ * with ENOBUFS, as policy says. A depth of 0 goes back to keeping only the
+ * last message written; the newest messages that fit are kept on a switch.
+ */
+struct msg_slot_queue
+{
+        unsigned int depth;
+        unsigned int policy; /* MSG_QUEUE_* */
+};
+
+#define MSG_QUEUE_BLOCK 0
+#define MSG_QUEUE_DROP_OLDEST 1
+#define MSG_QUEUE_ERROR 2
+#define MSG_QUEUE_MAX_DEPTH 4096
+
+/*
+ * mmap of a file maps the ring of its channel, which is created by the first
+ * mmap: one page holding this header, then size bytes of records, size being
+ * the mapping's length less a page and a power of 2 number of pages. The
+ * ring is charged to the slot's quota, so an mmap of a ring larger than what
+ * the quota has left fails with ENOSPC: with the default 1 MiB quota, rings
+ * stay under MSG_RING_MAX_SIZE unless the quota is raised. A mapping keeps
+ * the channel from being evicted, and the ring goes with the channel once no
+ * mapping is left.
+ *
+ * A record is its length, then its bytes, padded to 8 bytes. A producer
+ * that would cross the end of the ring first writes a MSG_RING_PAD record up
+ * to it. head and tail only grow, and are taken modulo size: the producer
+ * writes a record, then publishes tail past it; the consumer reads it, then
+ * publishes head past it. There is one producer and one consumer at a time;
+ * more of either have to serialize among themselves.
+ *
+ * Nothing takes a system call but waiting: a consumer with nothing to read
+ * calls msg_ring_wait_prepare, which sets waiting and reads tail once more,
+ * and polls the file, which is readable when the ring is not empty, if the
+ * ring is still empty. A producer calls msg_ring_notify after its pushes, and
+ * issues MSG_SLOT_RING_WAKE if it says a consumer is waiting. Each side
+ * stores and then loads what the other stores, so both need a full fence in
+ * between, or else each may miss the other's store and the wakeup is lost.
+ */
+struct msg_slot_ring
+{
+        unsigned int head;        /* Advanced by the consumer */
+        unsigned int tail;        /* Advanced by the producer */
+        unsigned int size;        /* Set by the module */
+        unsigned int data_offset; /* From the header to the records, a page */
+        unsigned int waiting;     /* Set by a consumer about to poll */
+};
+
+#define MSG_RING_MAX_SIZE (1 << 24)
+#define MSG_RING_PAD 0xffffffffU
+#define MSG_RING_RECORD_LEN(length) ((sizeof(unsigned int) + (length) + 7) & ~(size_t)7)
+
+#ifndef __KERNEL__
+#include <string.h>
+
+static inline char *msg_ring_data(struct msg_slot_ring *ring)
+{
+        return (char *)ring + ring->data_offset;
+}
+
+/*
+ * Returns 0, or -1 if the ring has no room for the message now
+ */
+static inline int msg_ring_push(struct msg_slot_ring *ring, const void *message, unsigned int length)
+{
+        unsigned int tail = ring->tail;
+        unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        unsigned int pos = tail & (ring->size - 1);
+        unsigned int pad = 0;
+        size_t record_len = MSG_RING_RECORD_LEN(length);
+        if (record_len > ring->size - pos)
+                pad = ring->size - pos;
+        if (pad + record_len > ring->size - (tail - head))
+                return -1;
+        if (pad)
+        {
+                *(unsigned int *)(msg_ring_data(ring) + pos) = MSG_RING_PAD;
+                tail += pad;
+                pos = 0;
+        }
+        *(unsigned int *)(msg_ring_data(ring) + pos) = length;
+        memcpy(msg_ring_data(ring) + pos + sizeof(unsigned int), message, length);
+        __atomic_store_n(&ring->tail, tail + (unsigned int)record_len, __ATOMIC_RELEASE);
+        return 0;
+}
+
+/*
+ * Copies the oldest message to buffer, and returns its length, or -1 if the
+ * ring is empty, or -2 if the message is longer than buffer_len and was left
+ */
+static inline long msg_ring_pop(struct msg_slot_ring *ring, void *buffer, size_t buffer_len)
+{
+        unsigned int head = ring->head;
+        unsigned int tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        unsigned int pos = head & (ring->size - 1);
+        unsigned int length;
+        if (head == tail)
+                return -1;
+        length = *(unsigned int *)(msg_ring_data(ring) + pos);
+        if (length == MSG_RING_PAD)
+        { /* A record always follows a pad */
+                head += ring->size - pos;
+                pos = 0;
+                length = *(unsigned int *)(msg_ring_data(ring));
+        }
+        if (length > buffer_len)
+                return -2;
+        memcpy(buffer, msg_ring_data(ring) + pos + sizeof(unsigned int), length);
+        __atomic_store_n(&ring->head, head + (unsigned int)MSG_RING_RECORD_LEN(length), __ATOMIC_RELEASE);
+        return length;
+}
+
+/*
+ * Called by a consumer that found the ring empty, before it polls the file.
+ * Returns whether the ring is still empty, so that it has to poll.
+ */
+static inline int msg_ring_wait_prepare(struct msg_slot_ring *ring)
+{
+        __atomic_store_n(&ring->waiting, 1, __ATOMIC_RELAXED);
+        /* Pairs with msg_ring_notify's: it sees waiting, or we see its tail */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == ring->head)
+                return 1;
+        __atomic_store_n(&ring->waiting, 0, __ATOMIC_RELAXED);
+        return 0;
+}
+
+/*
+ * Called by a producer after its pushes. Returns whether a consumer is
+ * waiting, so that it has to issue MSG_SLOT_RING_WAKE, and clears waiting.
+ */
+static inline int msg_ring_notify(struct msg_slot_ring *ring)
+{
+        /* Pairs with msg_ring_wait_prepare's: it sees our tail, or we see waiting */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&ring->waiting, __ATOMIC_RELAXED))
+                return 0;
+        return __atomic_exchange_n(&ring->waiting, 0, __ATOMIC_RELAXED);
+}
+#endif
+
 #endif
 
@@ -0,0 +1,145 @@
+/*
+ * The user space stand-ins of msg_compat.h that are not inline
+ */
+
+#include "msg_compat.h"
+
+#define XA_MIN_SIZE 64
+
+pthread_rwlock_t compat_rcu_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static unsigned long xa_hash(unsigned long index)
+{
+        return index * 0x9e3779b97f4a7c15UL;
+}
+
+void xa_init(struct xarray *xa)
+{
+        pthread_rwlock_init(&xa->lock, NULL);
+        xa->indices = NULL;
+        xa->entries = NULL;
+        xa->size = 0;
+        xa->used = 0;
+}
+
+/*
+ * Returns the position of index in the table, or the free one it would take
+ */
+static unsigned long xa_position(const struct xarray *xa, unsigned long index)
+{
+        unsigned long position = xa_hash(index) & (xa->size - 1);
+        while (xa->entries[position] != NULL && xa->indices[position] != index)
+                position = (position + 1) & (xa->size - 1);
+        return position;
+}
+
+void *xa_load(struct xarray *xa, unsigned long index)
+{
+        void *entry = NULL;
+        pthread_rwlock_rdlock(&xa->lock);
+        if (xa->size != 0)
+                entry = xa->entries[xa_position(xa, index)];
+        pthread_rwlock_unlock(&xa->lock);
+        return entry;
+}
+
+/*
+ * Doubles the table, which is kept at most half full
+ */
+static int xa_grow(struct xarray *xa)
+{
+        struct xarray grown = {.size = xa->size ? xa->size * 2 : XA_MIN_SIZE};
+        unsigned long i, position;
+        grown.indices = calloc(grown.size, sizeof(unsigned long));
+        grown.entries = calloc(grown.size, sizeof(void *));
+        if (grown.indices == NULL || grown.entries == NULL)
+        {
+                free(grown.indices);
+                free(grown.entries);
+                return -ENOMEM;
+        }
+        for (i = 0; i < xa->size; ++i)
+        {
+                if (xa->entries[i] == NULL)
+                        continue;
+                position = xa_position(&grown, xa->indices[i]);
+                grown.indices[position] = xa->indices[i];
+                grown.entries[position] = xa->entries[i];
+        }
+        free(xa->indices);
+        free(xa->entries);
+        xa->indices = grown.indices;
+        xa->entries = grown.entries;
+        xa->size = grown.size;
+        return 0;
+}
+
+int xa_insert(struct xarray *xa, unsigned long index, void *entry, int gfp)
+{
+        unsigned long position;
+        int rc = 0;
+        pthread_rwlock_wrlock(&xa->lock);
+        if (2 * (xa->used + 1) > xa->size)
+                rc = xa_grow(xa);
+        if (rc == 0)
+        {
+                position = xa_position(xa, index);
+                if (xa->entries[position] != NULL)
+                        rc = -EBUSY;
+                else
+                {
+                        xa->indices[position] = index;
+                        xa->entries[position] = entry;
+                        ++xa->used;
+                }
+        }
+        pthread_rwlock_unlock(&xa->lock);
+        return rc;
+}
+
+/*
+ * Under xa_lock. Moves back the entries after the erased one that would not
+ * be found past the hole otherwise.
+ */
+void *__xa_erase(struct xarray *xa, unsigned long index)
+{
+        unsigned long hole, position, home;
+        void *entry;
+        if (xa->size == 0)
+                return NULL;
+        hole = xa_position(xa, index);
+        entry = xa->entries[hole];
+        if (entry == NULL)
+                return NULL;
+        xa->entries[hole] = NULL;
+        --xa->used;
+        for (position = (hole + 1) & (xa->size - 1); xa->entries[position] != NULL;
+             position = (position + 1) & (xa->size - 1))
+        {
+                home = xa_hash(xa->indices[position]) & (xa->size - 1);
+                /* Whether home is cyclically in (hole, position] */
+                if (((position - home) & (xa->size - 1)) < ((position - hole) & (xa->size - 1)))
+                        continue;
+                xa->indices[hole] = xa->indices[position];
+                xa->entries[hole] = xa->entries[position];
+                xa->entries[position] = NULL;
+                hole = position;
+        }
+        return entry;
+}
+
+void *xa_find_position(struct xarray *xa, unsigned long *position)
+{
+        for (; *position < xa->size; ++*position)
+                if (xa->entries[*position] != NULL)
+                        return xa->entries[*position];
+        return NULL;
+}
+
+void xa_destroy(struct xarray *xa)
+{
+        free(xa->indices);
+        free(xa->entries);
+        pthread_rwlock_destroy(&xa->lock);
+        xa_init(xa);
+}
@@ -0,0 +1,426 @@
+#ifndef MSG_COMPAT_H
+#define MSG_COMPAT_H
+
+/*
+ * The kernel interfaces msg_store.c uses. In the module they are the kernel's
+ * own; built in user space, for msgslot_bench, they are stood in for with
+ * pthreads and compiler atomics, enough to run the same code in-process:
+ * an iov_iter is a plain buffer, RCU is a reader-writer lock that call_rcu
+ * waits for, per-CPU counters are shared atomic ones, and the xarray is a
+ * locked hash table.
+ */
+
+#ifdef __KERNEL__
+
+#include <linux/kernel.h>
+#include <linux/string.h>    /* For memset */
+#include <linux/slab.h>      /* For slab allocation */
+#include <linux/xarray.h>    /* For the channels of a slot */
+#include <linux/atomic.h>    /* For cmpxchg */
+#include <linux/rcupdate.h>  /* For the lock-free read path */
+#include <linux/refcount.h>  /* For the references to messages */
+#include <linux/spinlock.h>  /* For the writers of a channel */
+#include <linux/uio.h>       /* For iov_iter */
+#include <linux/mm.h>        /* For kvmalloc */
+#include <linux/wait.h>      /* For blocking reads */
+#include <linux/vmalloc.h>   /* For the rings */
+#include <linux/log2.h>      /* For is_power_of_2 */
+#include <linux/percpu.h>    /* For the statistics */
+#include <linux/list.h>      /* For the LRU of channels */
+#include <linux/jiffies.h>   /* For idle channels */
+
+#else
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+
+typedef uint64_t u64;
+
+#define __user
+#define __rcu
+#define GFP_KERNEL 0
+#define PAGE_SIZE 4096UL
+#define MAX_ERRNO 4095
+
+#define READ_ONCE(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define WRITE_ONCE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+/* Returns the old value, as the kernel's does */
+#define cmpxchg(p, o, n) ({ __typeof__(*(p)) _old = (o); \
+        __atomic_compare_exchange_n((p), &_old, (n), false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); _old; })
+
+#define ERR_PTR(e) ((void *)(long)(e))
+#define PTR_ERR(p) ((long)(p))
+#define IS_ERR(p) ((unsigned long)(p) >= (unsigned long)-MAX_ERRNO)
+#define IS_ERR_OR_NULL(p) ((p) == NULL || IS_ERR(p))
+
+#define container_of(p, type, member) ((type *)((char *)(p) - offsetof(type, member)))
+#define struct_size(p, member, n) (sizeof(*(p)) + (n) * sizeof((p)->member[0]))
+#define min_t(type, a, b) ((type)(a) < (type)(b) ? (type)(a) : (type)(b))
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define u64_to_user_ptr(x) ((void *)(uintptr_t)(x))
+
+static inline int fls(unsigned int x)
+{
+        return x ? 32 - __builtin_clz(x) : 0;
+}
+
+#define smp_mb() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+/* Milliseconds of CLOCK_MONOTONIC */
+#define HZ 1000
+#define jiffies compat_jiffies()
+#define time_after_eq(a, b) ((long)((a) - (b)) >= 0)
+#define time_before(a, b) ((long)((a) - (b)) < 0)
+
+static inline unsigned long compat_jiffies(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (unsigned long)ts.tv_sec * HZ + (unsigned long)ts.tv_nsec / (1000000000 / HZ);
+}
+
+static inline bool is_power_of_2(unsigned long n)
+{
+        return n != 0 && (n & (n - 1)) == 0;
+}
+
+/* A single segment, as import_ubuf makes */
+struct iov_iter
+{
+        char *base;
+        size_t count;
+};
+
+#define ITER_SOURCE 1
+#define ITER_DEST 0
+
+static inline int import_ubuf(int direction, void *buf, size_t len, struct iov_iter *i)
+{
+        i->base = buf;
+        i->count = len;
+        return 0;
+}
+
+static inline size_t iov_iter_count(const struct iov_iter *i)
+{
+        return i->count;
+}
+
+static inline size_t copy_to_iter(const void *addr, size_t bytes, struct iov_iter *i)
+{
+        bytes = bytes < i->count ? bytes : i->count;
+        memcpy(i->base, addr, bytes);
+        i->base += bytes;
+        i->count -= bytes;
+        return bytes;
+}
+
+static inline size_t copy_from_iter(void *addr, size_t bytes, struct iov_iter *i)
+{
+        bytes = bytes < i->count ? bytes : i->count;
+        memcpy(addr, i->base, bytes);
+        i->base += bytes;
+        i->count -= bytes;
+        return bytes;
+}
+
+/* Allocation */
+
+#define kmalloc(size, gfp) malloc(size)
+#define kzalloc(size, gfp) calloc(1, size)
+#define kcalloc(n, size, gfp) calloc(n, size)
+#define kvmalloc(size, gfp) malloc(size)
+#define vmalloc_user(size) calloc(1, size)
+#define kfree(p) free((void *)(p))
+#define kvfree(p) free((void *)(p))
+#define vfree(p) free((void *)(p))
+
+struct kmem_cache
+{
+        size_t size;
+};
+
+static inline struct kmem_cache *kmem_cache_create_usercopy(const char *name, unsigned int size,
+                                                            unsigned int align, unsigned long flags,
+                                                            unsigned int useroffset, unsigned int usersize,
+                                                            void (*ctor)(void *))
+{
+        struct kmem_cache *cache = malloc(sizeof(struct kmem_cache));
+        if (cache != NULL)
+                cache->size = size;
+        return cache;
+}
+
+static inline void kmem_cache_destroy(struct kmem_cache *cache)
+{
+        free(cache);
+}
+
+static inline void *kmem_cache_alloc(struct kmem_cache *cache, int gfp)
+{
+        return malloc(cache->size);
+}
+
+static inline void kmem_cache_free(struct kmem_cache *cache, void *p)
+{
+        free(p);
+}
+
+/* Atomics */
+
+typedef struct
+{
+        int counter;
+} atomic_t;
+
+typedef struct
+{
+        long counter;
+} atomic_long_t;
+
+typedef struct
+{
+        long long counter;
+} atomic64_t;
+
+typedef struct
+{
+        int refs;
+} refcount_t;
+
+#define ATOMIC_LONG_INIT(v) {(v)}
+#define ATOMIC64_INIT(v) {(v)}
+#define atomic_set(a, v) __atomic_store_n(&(a)->counter, (v), __ATOMIC_RELAXED)
+#define atomic_read(a) __atomic_load_n(&(a)->counter, __ATOMIC_RELAXED)
+#define atomic_inc(a) __atomic_fetch_add(&(a)->counter, 1, __ATOMIC_RELAXED)
+#define atomic_dec(a) __atomic_fetch_sub(&(a)->counter, 1, __ATOMIC_RELAXED)
+#define atomic_long_add(d, a) __atomic_fetch_add(&(a)->counter, (d), __ATOMIC_SEQ_CST)
+#define atomic_long_set atomic_set
+#define atomic_long_read atomic_read
+#define atomic_long_sub(d, a) __atomic_fetch_sub(&(a)->counter, (d), __ATOMIC_SEQ_CST)
+#define atomic_long_add_return(d, a) __atomic_add_fetch(&(a)->counter, (d), __ATOMIC_SEQ_CST)
+#define atomic64_inc_return(a) __atomic_add_fetch(&(a)->counter, 1, __ATOMIC_SEQ_CST)
+
+static inline void refcount_set(refcount_t *r, int n)
+{
+        __atomic_store_n(&r->refs, n, __ATOMIC_RELAXED);
+}
+
+static inline int refcount_read(const refcount_t *r)
+{
+        return __atomic_load_n(&r->refs, __ATOMIC_RELAXED);
+}
+
+static inline bool refcount_inc_not_zero(refcount_t *r)
+{
+        int refs = __atomic_load_n(&r->refs, __ATOMIC_RELAXED);
+        do
+                if (refs == 0)
+                        return false;
+        while (!__atomic_compare_exchange_n(&r->refs, &refs, refs + 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+        return true;
+}
+
+static inline bool refcount_dec_and_test(refcount_t *r)
+{
+        return __atomic_sub_fetch(&r->refs, 1, __ATOMIC_ACQ_REL) == 0;
+}
+
+static inline void refcount_dec(refcount_t *r)
+{
+        __atomic_fetch_sub(&r->refs, 1, __ATOMIC_RELEASE);
+}
+
+static inline bool refcount_dec_if_one(refcount_t *r)
+{
+        int one = 1;
+        return __atomic_compare_exchange_n(&r->refs, &one, 0, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+
+/* Lists */
+
+struct list_head
+{
+        struct list_head *next, *prev;
+};
+
+#define LIST_HEAD(name) struct list_head name = {&(name), &(name)}
+#define list_entry(p, type, member) container_of(p, type, member)
+#define list_for_each_entry_safe(pos, n, head, member) \
+        for ((pos) = list_entry((head)->next, __typeof__(*(pos)), member), \
+            (n) = list_entry((pos)->member.next, __typeof__(*(pos)), member); \
+             &(pos)->member != (head); \
+             (pos) = (n), (n) = list_entry((n)->member.next, __typeof__(*(n)), member))
+
+static inline void INIT_LIST_HEAD(struct list_head *list)
+{
+        list->next = list->prev = list;
+}
+
+static inline void list_add_tail(struct list_head *entry, struct list_head *head)
+{
+        entry->prev = head->prev;
+        entry->next = head;
+        head->prev->next = entry;
+        head->prev = entry;
+}
+
+static inline void list_del_init(struct list_head *entry)
+{
+        entry->prev->next = entry->next;
+        entry->next->prev = entry->prev;
+        INIT_LIST_HEAD(entry);
+}
+
+static inline void list_move_tail(struct list_head *entry, struct list_head *head)
+{
+        list_del_init(entry);
+        list_add_tail(entry, head);
+}
+
+/* Per-CPU counters, shared by all threads */
+
+#define DEFINE_PER_CPU(type, name) type name
+#define this_cpu_inc(x) __atomic_fetch_add(&(x), 1, __ATOMIC_RELAXED)
+#define this_cpu_add(x, v) __atomic_fetch_add(&(x), (v), __ATOMIC_RELAXED)
+#define per_cpu_ptr(p, cpu) (p)
+#define for_each_possible_cpu(cpu) for ((cpu) = 0; (cpu) < 1; ++(cpu))
+
+/* Locks and waiting */
+
+/*
+ * A ticket lock, first come first served as the kernel's spinlocks are: a
+ * mutex would let a thread that keeps taking it starve the others
+ */
+typedef struct
+{
+        unsigned int next;
+        unsigned int owner;
+} spinlock_t;
+
+#define SPIN_YIELD_AFTER 64
+#define DEFINE_SPINLOCK(name) spinlock_t name = {0, 0}
+
+static inline void spin_lock_init(spinlock_t *lock)
+{
+        lock->next = lock->owner = 0;
+}
+
+static inline void spin_lock(spinlock_t *lock)
+{
+        unsigned int ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+        unsigned int spins = 0;
+        while (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket)
+                if (++spins % SPIN_YIELD_AFTER == 0)
+                        sched_yield(); /* The owner may not be running */
+}
+
+static inline void spin_unlock(spinlock_t *lock)
+{
+        __atomic_store_n(&lock->owner, lock->owner + 1, __ATOMIC_RELEASE);
+}
+
+#define lockdep_is_held(l) 1
+
+typedef struct
+{
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        int sleepers;
+} wait_queue_head_t;
+
+static inline void init_waitqueue_head(wait_queue_head_t *wq)
+{
+        pthread_mutex_init(&wq->lock, NULL);
+        pthread_cond_init(&wq->cond, NULL);
+        wq->sleepers = 0;
+}
+
+static inline bool wq_has_sleeper(wait_queue_head_t *wq)
+{
+        return __atomic_load_n(&wq->sleepers, __ATOMIC_SEQ_CST) != 0;
+}
+
+static inline void wake_up_interruptible_all(wait_queue_head_t *wq)
+{
+        pthread_mutex_lock(&wq->lock);
+        pthread_cond_broadcast(&wq->cond);
+        pthread_mutex_unlock(&wq->lock);
+}
+
+#define wake_up_interruptible wake_up_interruptible_all
+
+/* condition is checked under the lock a waker takes, so no wakeup is lost */
+#define wait_event_interruptible(wq, condition) ({ \
+        pthread_mutex_lock(&(wq).lock); \
+        __atomic_fetch_add(&(wq).sleepers, 1, __ATOMIC_SEQ_CST); \
+        while (!(condition)) \
+                pthread_cond_wait(&(wq).cond, &(wq).lock); \
+        __atomic_fetch_sub(&(wq).sleepers, 1, __ATOMIC_SEQ_CST); \
+        pthread_mutex_unlock(&(wq).lock); \
+        0; })
+
+/* RCU: call_rcu waits for the readers there are, and rcu_barrier has nothing to wait for */
+
+struct rcu_head
+{
+        void *unused;
+};
+
+extern pthread_rwlock_t compat_rcu_lock;
+
+#define rcu_read_lock() pthread_rwlock_rdlock(&compat_rcu_lock)
+#define rcu_read_unlock() pthread_rwlock_unlock(&compat_rcu_lock)
+#define rcu_dereference(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define rcu_dereference_protected(p, c) (p)
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+#define RCU_INIT_POINTER(p, v) ((p) = (v))
+#define rcu_barrier() do { } while (0)
+
+static inline void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *))
+{
+        pthread_rwlock_wrlock(&compat_rcu_lock);
+        pthread_rwlock_unlock(&compat_rcu_lock);
+        func(head);
+}
+
+/*
+ * The xarray: a hash table of the entries under a reader-writer lock. What
+ * xa_for_each sets index to is a position in the table, not an entry's index.
+ */
+
+struct xarray
+{
+        pthread_rwlock_t lock;
+        unsigned long *indices;
+        void **entries; /* NULL for a free position */
+        unsigned long size; /* A power of 2 */
+        unsigned long used;
+};
+
+void xa_init(struct xarray *xa);
+void *xa_load(struct xarray *xa, unsigned long index);
+int xa_insert(struct xarray *xa, unsigned long index, void *entry, int gfp);
+void *xa_find_position(struct xarray *xa, unsigned long *position);
+void *__xa_erase(struct xarray *xa, unsigned long index);
+
+#define xa_lock(xa) pthread_rwlock_wrlock(&(xa)->lock)
+#define xa_unlock(xa) pthread_rwlock_unlock(&(xa)->lock)
+void xa_destroy(struct xarray *xa);
+
+#define xa_for_each(xa, index, entry) \
+        for ((index) = 0; ((entry) = xa_find_position((xa), &(index))) != NULL; ++(index))
+
+#endif
+
+#endif
@@ -0,0 +1,818 @@
+/*
+ * The slots, channels and messages behind the message slot device, apart
+ * from the files that reach them. Built into the module, and with
+ * msg_compat.c into msgslot_bench in user space.
+ */
+
+#include "msg_store.h"
+
+/*
+ * Messages of up to 2048 bytes, with their header, come from one of the
+ * size-classed caches 64, 128, ..., 2048, and longer ones from kvmalloc
+ */
+#define MSG_CACHE_MIN_SHIFT 6
+#define MSG_CACHES_NUM 6
+#define MSG_KVMALLOC MSG_CACHES_NUM
+
+/* How often a channel in use moves to the back of channels_lru, at most */
+#define LRU_TOUCH_DELAY (HZ / 10)
+
+static DEFINE_PER_CPU(struct msg_stats, msg_stats);
+
+static struct kmem_cache *msg_caches[MSG_CACHES_NUM];
+
+unsigned long slot_quota = 1 << 20;
+unsigned long store_cap;
+unsigned int idle_timeout;
+
+/* Every channel of every slot, least recently used first */
+static LIST_HEAD(channels_lru);
+static DEFINE_SPINLOCK(lru_lock);
+
+/* What all slots hold, for store_cap */
+static atomic_long_t store_bytes = ATOMIC_LONG_INIT(0);
+
+/*
+ * Numbers the messages of all channels, so that a channel evicted and created
+ * again never reuses a number a reader of the old one may have recorded
+ */
+static atomic64_t msg_seq = ATOMIC64_INIT(0);
+
+/* Indexed by minor, NULL until the slot is first opened */
+static struct slot *slots[SLOTS_NUM];
+
+struct slot *find_slot(unsigned int minor)
+{
+        return minor < SLOTS_NUM ? READ_ONCE(slots[minor]) : NULL;
+}
+
+/*
+ * Moves the channel to the back of channels_lru, unless it moved there less
+ * than LRU_TOUCH_DELAY ago, so that a busy channel seldom takes lru_lock
+ */
+static void touch_channel(struct channel *channel)
+{
+        unsigned long now = jiffies;
+        if (time_before(now, READ_ONCE(channel->last_used) + LRU_TOUCH_DELAY))
+                return;
+        spin_lock(&lru_lock);
+        WRITE_ONCE(channel->last_used, now);
+        list_move_tail(&channel->lru, &channels_lru);
+        spin_unlock(&lru_lock);
+}
+
+struct channel *find_channel(struct slot *slot, unsigned int channel_id)
+{
+        struct channel *channel;
+        rcu_read_lock();
+        channel = xa_load(&slot->channels, channel_id);
+        if (channel != NULL && !refcount_inc_not_zero(&channel->refs))
+        {
+                /* evict_channel is deciding whether to keep it, under xa_lock */
+                xa_lock(&slot->channels);
+                xa_unlock(&slot->channels);
+                channel = xa_load(&slot->channels, channel_id);
+                /* One evicted is as good as gone */
+                if (channel != NULL && !refcount_inc_not_zero(&channel->refs))
+                        channel = NULL;
+        }
+        rcu_read_unlock();
+        this_cpu_inc(msg_stats.lookups);
+        if (channel == NULL)
+        {
+                this_cpu_inc(msg_stats.lookup_misses);
+                return NULL;
+        }
+        touch_channel(channel);
+        return channel;
+}
+
+void put_channel(struct channel *channel)
+{
+        /* Never the last reference, which is the slot's */
+        refcount_dec(&channel->refs);
+}
+
+int new_slot(unsigned char minor)
+{
+        struct slot *slot;
+        slot = kmalloc(sizeof(struct slot), GFP_KERNEL);
+        if (slot == NULL)
+                return -ENOMEM;
+        slot->minor = minor;
+        xa_init(&slot->channels);
+        slot->quota = READ_ONCE(slot_quota);
+        atomic_long_set(&slot->bytes_used, 0);
+        atomic_set(&slot->channels_num, 0);
+        /* Another open of this minor may have won the race */
+        if (cmpxchg(&slots[minor], NULL, slot) != NULL)
+                kfree(slot);
+        return SUCCESS;
+}
+
+/*
+ * Adds a new channel to what the store holds, reclaiming channels first if
+ * that would take it over store_cap. Returns false if it still would.
+ */
+static bool charge_new_channel(void)
+{
+        unsigned long cap = READ_ONCE(store_cap);
+        if (cap != 0 && atomic_long_read(&store_bytes) + sizeof(struct channel) > cap)
+        {
+                msg_store_reclaim();
+                if (atomic_long_read(&store_bytes) + sizeof(struct channel) > cap)
+                        return false;
+        }
+        atomic_long_add(sizeof(struct channel), &store_bytes);
+        return true;
+}
+
+/*
+ * Returns the channel, created empty if it does not exist yet, or an ERR_PTR
+ */
+struct channel *new_channel(struct slot *slot, unsigned int channel_id)
+{
+        struct channel *channel;
+        struct channel *existing = NULL;
+        int rc;
+        if (!charge_new_channel())
+                return ERR_PTR(-ENOSPC);
+        channel = kmalloc(sizeof(struct channel), GFP_KERNEL);
+        if (channel == NULL)
+        {
+                atomic_long_sub(sizeof(struct channel), &store_bytes);
+                return ERR_PTR(-ENOMEM);
+        }
+        channel->channel_id = channel_id;
+        channel->slot = slot;
+        refcount_set(&channel->refs, 2); /* The slot's and ours */
+        channel->last_used = jiffies;
+        spin_lock_init(&channel->lock);
+        RCU_INIT_POINTER(channel->message, NULL);
+        init_waitqueue_head(&channel->waitq);
+        channel->queue = NULL;
+        channel->queue_depth = channel->queue_head = channel->queue_len = 0;
+        channel->queue_policy = MSG_QUEUE_BLOCK;
+        init_waitqueue_head(&channel->writers_waitq);
+        channel->ring = NULL;
+        channel->ring_size = 0;
+        /* Before it can be found, so that it is found on the list */
+        spin_lock(&lru_lock);
+        list_add_tail(&channel->lru, &channels_lru);
+        spin_unlock(&lru_lock);
+        while ((rc = xa_insert(&slot->channels, channel_id, channel, GFP_KERNEL)) == -EBUSY)
+        {
+                /* Another write to this channel created it first, unless that one was just evicted */
+                existing = find_channel(slot, channel_id);
+                if (existing != NULL)
+                        break;
+        }
+        if (rc == 0)
+        {
+                this_cpu_inc(msg_stats.channels_created);
+                atomic_inc(&slot->channels_num);
+                return channel;
+        }
+        spin_lock(&lru_lock);
+        list_del_init(&channel->lru);
+        spin_unlock(&lru_lock);
+        kfree(channel);
+        atomic_long_sub(sizeof(struct channel), &store_bytes);
+        return rc == -EBUSY ? existing : ERR_PTR(rc);
+}
+
+static void free_channel_rcu(struct rcu_head *rcu)
+{
+        struct channel *channel = container_of(rcu, struct channel, rcu);
+        vfree(channel->ring); /* Not under lru_lock, as evict_channel is */
+        kfree(channel);
+}
+
+/*
+ * Returns a message of length bytes with a single reference, or NULL
+ */
+static struct message *alloc_message(size_t length)
+{
+        struct message *message;
+        size_t size = struct_size(message, data, length);
+        unsigned int cache = 0;
+        while (cache < MSG_CACHES_NUM && size > 1UL << (MSG_CACHE_MIN_SHIFT + cache))
+                ++cache;
+        if (cache < MSG_CACHES_NUM)
+                message = kmem_cache_alloc(msg_caches[cache], GFP_KERNEL);
+        else
+                message = kvmalloc(size, GFP_KERNEL);
+        if (message == NULL)
+                return NULL;
+        refcount_set(&message->refs, 1);
+        message->cache = cache;
+        message->length = length;
+        return message;
+}
+
+static void free_message(struct message *message)
+{
+        if (message->cache == MSG_KVMALLOC)
+                kvfree(message);
+        else
+                kmem_cache_free(msg_caches[message->cache], message);
+}
+
+static void free_message_rcu(struct rcu_head *rcu)
+{
+        free_message(container_of(rcu, struct message, rcu));
+}
+
+void put_message(struct message *message)
+{
+        if (message != NULL && refcount_dec_and_test(&message->refs))
+                call_rcu(&message->rcu, free_message_rcu);
+}
+
+/*
+ * Returns the current message of the channel with a reference taken, or NULL
+ */
+static struct message *get_message(struct channel *channel)
+{
+        struct message *message;
+        rcu_read_lock();
+        /* If a write replaced it and it is going, the new one is published */
+        do
+                message = rcu_dereference(channel->message);
+        while (message != NULL && !refcount_inc_not_zero(&message->refs));
+        rcu_read_unlock();
+        return message;
+}
+
+/*
+ * Adds delta bytes to what the slot holds, unless that takes it over its
+ * quota. Shrinking is always allowed, even over a lowered quota.
+ */
+static bool charge_slot(struct slot *slot, long delta)
+{
+        unsigned long quota = READ_ONCE(slot->quota);
+        long used = atomic_long_add_return(delta, &slot->bytes_used);
+        if (delta > 0 && quota != 0 && (unsigned long)used > quota)
+        {
+                atomic_long_sub(delta, &slot->bytes_used);
+                return false;
+        }
+        atomic_long_add(delta, &store_bytes);
+        return true;
+}
+
+/*
+ * Publishes message as the channel's, and drops the channel's reference to
+ * the one it replaces. Returns -ENOSPC, leaving the channel as it is, if that
+ * would take the slot over its quota.
+ */
+static int set_message(struct slot *slot, struct channel *channel, struct message *message)
+{
+        struct message *old;
+        long delta;
+        spin_lock(&channel->lock);
+        old = rcu_dereference_protected(channel->message,
+                                        lockdep_is_held(&channel->lock));
+        delta = (long)message->length - (old != NULL ? (long)old->length : 0);
+        if (!charge_slot(slot, delta))
+        {
+                spin_unlock(&channel->lock);
+                return -ENOSPC;
+        }
+        message->seq = atomic64_inc_return(&msg_seq);
+        rcu_assign_pointer(channel->message, message);
+        spin_unlock(&channel->lock);
+        put_message(old);
+        wake_up_interruptible_all(&channel->waitq);
+        return SUCCESS;
+}
+
+/*
+ * In queued mode, appends message to the channel's queue, making room as its
+ * policy says when the queue is full. Returns 0, or -errno, or 1 if the
+ * channel is not in queued mode.
+ */
+static int enqueue_message(struct slot *slot, struct channel *channel, struct message *message, bool nonblock)
+{
+        struct message *dropped;
+        long delta;
+        int rc;
+        while (true)
+        {
+                dropped = NULL;
+                spin_lock(&channel->lock);
+                if (channel->queue == NULL)
+                {
+                        spin_unlock(&channel->lock);
+                        return 1;
+                }
+                if (channel->queue_len < channel->queue_depth)
+                        break;
+                if (channel->queue_policy == MSG_QUEUE_DROP_OLDEST)
+                {
+                        dropped = channel->queue[channel->queue_head];
+                        break;
+                }
+                spin_unlock(&channel->lock);
+                if (channel->queue_policy == MSG_QUEUE_ERROR)
+                        return -ENOBUFS;
+                if (nonblock)
+                        return -EAGAIN;
+                rc = wait_event_interruptible(channel->writers_waitq,
+                                              READ_ONCE(channel->queue_len) < READ_ONCE(channel->queue_depth) ||
+                                                  READ_ONCE(channel->queue) == NULL);
+                if (rc)
+                        return rc;
+        }
+        delta = (long)message->length - (dropped != NULL ? (long)dropped->length : 0);
+        if (!charge_slot(slot, delta))
+        {
+                spin_unlock(&channel->lock);
+                return -ENOSPC;
+        }
+        if (dropped != NULL)
+        {
+                channel->queue_head = (channel->queue_head + 1) % channel->queue_depth;
+                --channel->queue_len;
+        }
+        message->seq = atomic64_inc_return(&msg_seq);
+        channel->queue[(channel->queue_head + channel->queue_len) % channel->queue_depth] = message;
+        WRITE_ONCE(channel->queue_len, channel->queue_len + 1);
+        spin_unlock(&channel->lock);
+        put_message(dropped);
+        wake_up_interruptible_all(&channel->waitq);
+        return SUCCESS;
+}
+
+/*
+ * In queued mode, takes the oldest message off the channel's queue if it fits
+ * in length bytes, and returns it, or an ERR_PTR. Returns NULL if the channel
+ * is not in queued mode.
+ */
+static struct message *dequeue_message(struct slot *slot, struct channel *channel, size_t length)
+{
+        struct message *message;
+        if (READ_ONCE(channel->queue) == NULL)
+                return NULL;
+        spin_lock(&channel->lock);
+        if (channel->queue == NULL)
+                message = NULL;
+        else if (channel->queue_len == 0)
+                message = ERR_PTR(-EWOULDBLOCK);
+        else if (channel->queue[channel->queue_head]->length > length)
+                message = ERR_PTR(-ENOSPC);
+        else
+        {
+                message = channel->queue[channel->queue_head];
+                channel->queue_head = (channel->queue_head + 1) % channel->queue_depth;
+                WRITE_ONCE(channel->queue_len, channel->queue_len - 1);
+                charge_slot(slot, -(long)message->length);
+        }
+        spin_unlock(&channel->lock);
+        if (!IS_ERR_OR_NULL(message))
+                wake_up_interruptible(&channel->writers_waitq);
+        return message;
+}
+
+/*
+ * Sets the channel to queued mode with a queue of depth messages, or back to
+ * holding a single message with a depth of 0. The newest messages that fit
+ * are kept, and the others dropped.
+ */
+int set_queue(struct slot *slot, struct channel *channel, unsigned int depth, unsigned int policy)
+{
+        struct message **queue = NULL;
+        struct message **old_queue;
+        struct message *old;
+        struct message *single[1];
+        unsigned int old_depth, old_head, old_len, i;
+        if (depth > MSG_QUEUE_MAX_DEPTH || policy > MSG_QUEUE_ERROR)
+                return -EINVAL;
+        if (depth != 0)
+        {
+                queue = kcalloc(depth, sizeof(*queue), GFP_KERNEL);
+                if (queue == NULL)
+                        return -ENOMEM;
+        }
+        spin_lock(&channel->lock);
+        old_queue = channel->queue;
+        old_depth = channel->queue_depth;
+        old_head = channel->queue_head;
+        old_len = channel->queue_len;
+        old = rcu_dereference_protected(channel->message,
+                                        lockdep_is_held(&channel->lock));
+        if (old_queue == NULL && old != NULL)
+        { /* The single message as a queue of one */
+                single[0] = old;
+                old_queue = single;
+                old_depth = 1;
+                old_head = 0;
+                old_len = 1;
+        }
+        /* Drop the oldest messages that do not fit, then move the others */
+        for (; old_len > (depth ? depth : 1); --old_len, old_head = (old_head + 1) % old_depth)
+        {
+                charge_slot(slot, -(long)old_queue[old_head]->length);
+                put_message(old_queue[old_head]); /* Only call_rcu */
+        }
+        if (depth != 0)
+        {
+                for (i = 0; i < old_len; ++i)
+                        queue[i] = old_queue[(old_head + i) % old_depth];
+                RCU_INIT_POINTER(channel->message, NULL);
+        }
+        else
+                rcu_assign_pointer(channel->message, old_len ? old_queue[old_head] : NULL);
+        channel->queue = queue;
+        channel->queue_depth = depth;
+        channel->queue_head = 0;
+        WRITE_ONCE(channel->queue_len, depth ? old_len : 0);
+        channel->queue_policy = policy;
+        spin_unlock(&channel->lock);
+        if (old_queue != single)
+                kfree(old_queue);
+        wake_up_interruptible_all(&channel->writers_waitq);
+        return SUCCESS;
+}
+
+/*
+ * Returns whether the channel has a message to read: one other than the one
+ * with sequence number last_seq, or any in queued mode
+ */
+bool has_new_message(struct channel *channel, u64 last_seq)
+{
+        struct message *message;
+        bool new_message;
+        if (READ_ONCE(channel->queue_len) != 0)
+                return true;
+        rcu_read_lock();
+        message = rcu_dereference(channel->message);
+        new_message = message != NULL && message->length != 0 && message->seq != last_seq;
+        rcu_read_unlock();
+        return new_message;
+}
+
+/*
+ * Returns whether the channel's ring has records to read. head and tail are
+ * only compared, as user space may have written anything there.
+ */
+bool ring_has_records(struct channel *channel)
+{
+        struct msg_slot_ring *ring = READ_ONCE(channel->ring);
+        return ring != NULL && READ_ONCE(ring->head) != READ_ONCE(ring->tail);
+}
+
+/*
+ * Returns the channel's ring of size bytes of records, created if it has
+ * none yet, or an ERR_PTR
+ */
+struct msg_slot_ring *channel_ring(struct slot *slot, struct channel *channel, unsigned long size)
+{
+        struct msg_slot_ring *ring = NULL;
+        if (READ_ONCE(channel->ring) == NULL)
+        {
+                if (!charge_slot(slot, size))
+                        return ERR_PTR(-ENOSPC);
+                ring = vmalloc_user(PAGE_SIZE + size); /* Zeroed */
+                if (ring == NULL)
+                {
+                        charge_slot(slot, -(long)size);
+                        return ERR_PTR(-ENOMEM);
+                }
+                ring->size = size;
+                ring->data_offset = PAGE_SIZE;
+        }
+        spin_lock(&channel->lock);
+        if (channel->ring == NULL && ring != NULL)
+        {
+                channel->ring_size = size;
+                WRITE_ONCE(channel->ring, ring);
+                ring = NULL;
+        }
+        spin_unlock(&channel->lock);
+        if (ring != NULL)
+        { /* Another mmap of this channel won the race */
+                vfree(ring);
+                charge_slot(slot, -(long)size);
+        }
+        /* ring_size rather than ring->size, which user space may change */
+        if (channel->ring_size != size)
+                return ERR_PTR(-EINVAL);
+        return channel->ring;
+}
+
+ssize_t count_result(ssize_t rc, bool write)
+{
+        if (rc >= 0 && write)
+        {
+                this_cpu_inc(msg_stats.writes);
+                this_cpu_add(msg_stats.bytes_written, rc);
+                this_cpu_inc(msg_stats.sizes[rc ? fls(rc) : 0]);
+        }
+        else if (rc >= 0)
+        {
+                this_cpu_inc(msg_stats.reads);
+                this_cpu_add(msg_stats.bytes_read, rc);
+        }
+        else if (rc == -EWOULDBLOCK)
+                this_cpu_inc(msg_stats.wouldblock);
+        else if (rc == -ENOSPC)
+                this_cpu_inc(msg_stats.nospc);
+        return rc;
+}
+
+/*
+ * Copies the channel's message to the iov_iter, or in queued mode takes its
+ * oldest one off the queue, and records its sequence number in last_seq if
+ * not NULL. The whole message fits in it, or none of it is copied.
+ */
+ssize_t read_message(struct slot *slot,
+                     struct channel *channel,
+                     struct iov_iter *to,
+                     u64 *last_seq)
+{
+        size_t length = iov_iter_count(to);
+        ssize_t bytes_read;
+        struct message *message;
+        bool dequeued;
+        message = dequeue_message(slot, channel, length);
+        if (IS_ERR(message))
+                return count_result(PTR_ERR(message), false);
+        dequeued = message != NULL;
+        /* A write that races with us is either all seen or not at all */
+        if (!dequeued)
+                message = get_message(channel);
+        if (message == NULL || (message->length == 0 && !dequeued))
+                bytes_read = -EWOULDBLOCK;
+        else if (message->length > length)
+                bytes_read = -ENOSPC;
+        else if (copy_to_iter(message->data, message->length, to) != message->length)
+                bytes_read = -EFAULT; /* Losing a dequeued message */
+        else
+        {
+                bytes_read = message->length;
+                if (last_seq != NULL)
+                        *last_seq = message->seq;
+        }
+        put_message(message);
+        return count_result(bytes_read, false);
+}
+
+/*
+ * Makes all of the iov_iter the channel's message, or in queued mode appends
+ * it to the queue
+ */
+ssize_t write_message(struct slot *slot,
+                      struct channel *channel,
+                      struct iov_iter *from,
+                      bool nonblock)
+{
+        size_t length = iov_iter_count(from);
+        int rc;
+        struct message *message;
+        /* The whole message is copied in, from every segment, before anyone can see it */
+        message = alloc_message(length);
+        if (message == NULL)
+                return -ENOMEM;
+        if (copy_from_iter(message->data, length, from) != length)
+                rc = -EFAULT;
+        else if ((rc = enqueue_message(slot, channel, message, nonblock)) > 0)
+                rc = set_message(slot, channel, message);
+        if (rc)
+        {
+                free_message(message); /* Never published */
+                return count_result(rc, true);
+        }
+        return count_result(length, true);
+}
+
+/*
+ * Whether the channel has someone on its waitqueues, where pollers stay
+ * between polls, which keeps it from being evicted. A mapping of its ring
+ * holds a reference instead.
+ */
+static bool channel_in_use(struct channel *channel)
+{
+        return wq_has_sleeper(&channel->waitq) || wq_has_sleeper(&channel->writers_waitq);
+}
+
+/*
+ * Takes the channel out of its slot, if the slot's reference is the only one
+ * left and it is not in use. Then frees its messages, and the channel itself
+ * after a grace period. Under lru_lock.
+ */
+static bool evict_channel(struct channel *channel)
+{
+        struct slot *slot = channel->slot;
+        struct message *message;
+        bool evicted = false;
+        xa_lock(&slot->channels);
+        /*
+         * Checked before the reference is dropped, so that find_channel never
+         * sees a channel that is kept with no reference. Only a poller that
+         * got on a waitqueue and let go of its reference in between is caught
+         * by the check after, which find_channel waits out under xa_lock.
+         */
+        if (refcount_read(&channel->refs) == 1 && !channel_in_use(channel) &&
+            refcount_dec_if_one(&channel->refs))
+        {
+                /* Whatever a user did before dropping its reference is seen */
+                smp_mb();
+                if (channel_in_use(channel))
+                        refcount_set(&channel->refs, 1);
+                else
+                {
+                        __xa_erase(&slot->channels, channel->channel_id);
+                        evicted = true;
+                }
+        }
+        xa_unlock(&slot->channels);
+        if (!evicted)
+                return false;
+        list_del_init(&channel->lru);
+        message = rcu_dereference_protected(channel->message, 1);
+        if (message != NULL)
+                charge_slot(slot, -(long)message->length);
+        put_message(message);
+        for (; channel->queue_len; --channel->queue_len)
+        {
+                message = channel->queue[channel->queue_head];
+                charge_slot(slot, -(long)message->length);
+                put_message(message);
+                channel->queue_head = (channel->queue_head + 1) % channel->queue_depth;
+        }
+        kfree(channel->queue);
+        if (channel->ring != NULL)
+                charge_slot(slot, -(long)channel->ring_size);
+        atomic_dec(&slot->channels_num);
+        atomic_long_sub(sizeof(struct channel), &store_bytes);
+        call_rcu(&channel->rcu, free_channel_rcu);
+        return true;
+}
+
+unsigned int msg_store_reclaim(void)
+{
+        unsigned long timeout = READ_ONCE(idle_timeout) * (unsigned long)HZ;
+        unsigned long cap = READ_ONCE(store_cap);
+        unsigned long now = jiffies;
+        struct channel *channel, *next, *first_kept = NULL;
+        unsigned int evicted = 0;
+        bool idle, over_cap;
+        spin_lock(&lru_lock);
+        list_for_each_entry_safe(channel, next, &channels_lru, lru)
+        {
+                /* Back to the channels kept in use below: all were looked at */
+                if (channel == first_kept)
+                        break;
+                idle = timeout != 0 && time_after_eq(now, READ_ONCE(channel->last_used) + timeout);
+                over_cap = cap != 0 && (unsigned long)atomic_long_read(&store_bytes) > cap;
+                /* The rest were used more recently still */
+                if (!idle && !over_cap)
+                        break;
+                if (!evict_channel(channel))
+                {
+                        /*
+                         * In use by a mapping or a waiter, so it counts as used now,
+                         * rather than being looked at again on every pass
+                         */
+                        WRITE_ONCE(channel->last_used, now);
+                        list_move_tail(&channel->lru, &channels_lru);
+                        if (first_kept == NULL)
+                                first_kept = channel;
+                        continue;
+                }
+                ++evicted;
+                if (idle)
+                        this_cpu_inc(msg_stats.evicted_idle);
+                else
+                        this_cpu_inc(msg_stats.evicted_lru);
+        }
+        spin_unlock(&lru_lock);
+        return evicted;
+}
+
+long msg_store_bytes(void)
+{
+        return atomic_long_read(&store_bytes);
+}
+
+/*
+ * Reads or writes the channel of a batch entry as read or write would, but
+ * never blocks, and returns what they would
+ */
+long long batch_entry(struct slot *slot,
+                      const struct msg_slot_batch_entry *entry,
+                      bool write)
+{
+        char __user *buffer = u64_to_user_ptr(entry->buffer);
+        struct channel *channel;
+        struct iov_iter iter;
+        long long rc;
+        /* Reads only copy the message, into however long a buffer */
+        if (entry->channel_id == 0 || buffer == NULL || (write && entry->length > MSG_MAX_LEN))
+                return -EINVAL;
+        rc = import_ubuf(write ? ITER_SOURCE : ITER_DEST, buffer, entry->length, &iter);
+        if (rc)
+                return rc;
+        channel = find_channel(slot, entry->channel_id);
+        if (channel == NULL && write)
+                channel = new_channel(slot, entry->channel_id);
+        if (IS_ERR(channel))
+                return PTR_ERR(channel);
+        if (channel == NULL)
+                return count_result(-EWOULDBLOCK, false);
+        if (write)
+                rc = write_message(slot, channel, &iter, true);
+        else
+                rc = read_message(slot, channel, &iter, NULL);
+        put_channel(channel);
+        return rc;
+}
+
+static void destroy_msg_caches(void)
+{
+        unsigned int cache;
+        for (cache = 0; cache < MSG_CACHES_NUM; ++cache)
+        {
+                kmem_cache_destroy(msg_caches[cache]); /* Which may be NULL */
+                msg_caches[cache] = NULL;
+        }
+}
+
+static int create_msg_caches(void)
+{
+        char name[32];
+        unsigned int cache;
+        unsigned int size;
+        for (cache = 0; cache < MSG_CACHES_NUM; ++cache)
+        {
+                size = 1U << (MSG_CACHE_MIN_SHIFT + cache);
+                snprintf(name, sizeof(name), "msgslot_%u", size);
+                /* Whitelisted for copies to and from user space, for hardened usercopy */
+                msg_caches[cache] = kmem_cache_create_usercopy(name, size, 0, 0,
+                                                               offsetof(struct message, data),
+                                                               size - offsetof(struct message, data), NULL);
+                if (msg_caches[cache] == NULL)
+                {
+                        destroy_msg_caches();
+                        return -ENOMEM;
+                }
+        }
+        return SUCCESS;
+}
+
+int msg_store_init(void)
+{
+        return create_msg_caches();
+}
+
+void msg_store_exit(void)
+{
+        unsigned int minor;
+        unsigned long channel_id;
+        struct slot *slot;
+        struct channel *channel;
+        for (minor = 0; minor < SLOTS_NUM; ++minor)
+        {
+                slot = slots[minor];
+                if (slot == NULL)
+                        continue;
+                xa_for_each(&slot->channels, channel_id, channel)
+                {
+                        put_message(rcu_dereference_protected(channel->message, 1));
+                        for (; channel->queue_len; --channel->queue_len)
+                        {
+                                put_message(channel->queue[channel->queue_head]);
+                                channel->queue_head = (channel->queue_head + 1) % channel->queue_depth;
+                        }
+                        kfree(channel->queue);
+                        vfree(channel->ring);
+                        kfree(channel);
+                }
+                xa_destroy(&slot->channels);
+                kfree(slot);
+                slots[minor] = NULL;
+        }
+        INIT_LIST_HEAD(&channels_lru);
+        atomic_long_set(&store_bytes, 0);
+        rcu_barrier(); /* For free_message_rcu, before its caches go */
+        destroy_msg_caches();
+}
+
+/*
+ * Sums up the statistics of every CPU in total
+ */
+void msg_store_stats(struct msg_stats *total)
+{
+        const u64 *from;
+        u64 *to = (u64 *)total;
+        unsigned int i;
+        int cpu;
+        memset(total, 0, sizeof(*total));
+        for_each_possible_cpu(cpu)
+        {
+                from = (const u64 *)per_cpu_ptr(&msg_stats, cpu);
+                for (i = 0; i < sizeof(*total) / sizeof(u64); ++i)
+                        to[i] += from[i];
+        }
+}
@@ -0,0 +1,157 @@
+#ifndef MSG_STORE_H
+#define MSG_STORE_H
+
+#include "msg_compat.h"
+#include "message_slot.h"
+
+/* register_chrdev takes minors 0 to 255, one slot each */
+#define SLOTS_NUM 256
+
+/* Messages of 0, 1, 2 to 3, ..., 2^14 to 2^15 - 1 bytes */
+#define STATS_SIZE_BUCKETS 16
+
+/*
+ * Counted by each CPU on its own, and only summed up when read from
+ * debugfs, so that counting writes no cache line other CPUs share. All u64,
+ * as msg_store_stats sums them as an array.
+ */
+struct msg_stats
+{
+        u64 reads;
+        u64 writes;
+        u64 bytes_read;
+        u64 bytes_written;
+        u64 wouldblock;       /* Reads that found no message */
+        u64 nospc;            /* Reads into too small a buffer, writes over quota */
+        u64 lookups;          /* Of channels */
+        u64 lookup_misses;
+        u64 channels_created;
+        u64 evicted_idle;     /* Channels, after idle_timeout */
+        u64 evicted_lru;      /* Channels, least recently used first, over store_cap */
+        u64 sizes[STATS_SIZE_BUCKETS]; /* Of the messages written */
+};
+
+/*
+ * A message is never changed once published: a write allocates a new one and
+ * swaps it in. The channel holds a reference, as does each reader copying it
+ * out, and the last one to drop its reference frees it after a grace period,
+ * since readers find it under rcu_read_lock before taking theirs.
+ */
+struct message
+{
+        struct rcu_head rcu;
+        refcount_t refs;
+        unsigned char cache; /* Index in msg_caches, or MSG_KVMALLOC */
+        u64 seq;             /* Of the write that published it, from 1, unique in the store */
+        size_t length;
+        char data[];
+};
+
+/*
+ * Readers take no lock: they load message with rcu_dereference. Writers
+ * serialize on lock only to swap it, and wake up the readers waiting on waitq.
+ *
+ * The slot's xarray holds a reference to the channel, as does each read,
+ * write, poll or ioctl using it. Eviction takes the channel out of the xarray
+ * only when that reference is the last, and frees it after a grace period,
+ * since find_channel takes its reference under rcu_read_lock.
+ *
+ * In queued mode, set with MSG_SLOT_QUEUE, message stays NULL and the
+ * messages are kept in the FIFO queue instead, which reads consume. Both
+ * take lock then, a lock of this channel only; writers blocked on a full
+ * queue wait on writers_waitq.
+ */
+struct channel
+{
+        unsigned int channel_id;
+        struct slot *slot;
+        refcount_t refs;
+        struct rcu_head rcu;
+        struct list_head lru;     /* In channels_lru, least recently used first */
+        unsigned long last_used;  /* In jiffies, updated every LRU_TOUCH_DELAY */
+        spinlock_t lock;
+        struct message __rcu *message; /* NULL until first written */
+        wait_queue_head_t waitq;
+        struct message **queue;    /* Of queue_depth, or NULL, under lock */
+        unsigned int queue_depth;
+        unsigned int queue_head;   /* Index of the oldest message */
+        unsigned int queue_len;
+        unsigned int queue_policy; /* MSG_QUEUE_* */
+        wait_queue_head_t writers_waitq;
+        struct msg_slot_ring *ring; /* NULL until first mapped, under lock */
+        unsigned long ring_size;    /* Of its records */
+};
+
+/*
+ * The channels of a slot are kept in an xarray indexed by channel_id, which
+ * only allocates nodes for the ranges of ids in use and looks one up with no
+ * hashing and no list walk
+ */
+struct slot
+{
+        unsigned int minor;
+        struct xarray channels;
+        unsigned long quota;       /* In bytes, 0 for no limit */
+        atomic_long_t bytes_used;  /* By the current messages of the channels */
+        atomic_t channels_num;
+};
+
+/* What a new slot's quota is, in bytes, 0 for no limit */
+extern unsigned long slot_quota;
+/* Bytes of channels, messages and rings all slots may hold, 0 for no limit */
+extern unsigned long store_cap;
+/* Seconds after which a channel no one uses is evicted, 0 for never */
+extern unsigned int idle_timeout;
+
+int msg_store_init(void);
+
+/*
+ * Frees every slot, channel and message, once nothing uses them anymore
+ */
+void msg_store_exit(void);
+
+void msg_store_stats(struct msg_stats *total);
+
+/* Bytes of channels, messages and rings all slots hold */
+long msg_store_bytes(void);
+
+/*
+ * Evicts the channels idle for idle_timeout, then the least recently used
+ * ones while the store is over store_cap. Returns how many it evicted.
+ */
+unsigned int msg_store_reclaim(void);
+
+struct slot *find_slot(unsigned int minor);
+
+/*
+ * Creates the slot of minor unless it exists. Returns 0, or -errno.
+ */
+int new_slot(unsigned char minor);
+
+/*
+ * Both return the channel with a reference taken, which put_channel drops
+ */
+struct channel *find_channel(struct slot *slot, unsigned int channel_id);
+struct channel *new_channel(struct slot *slot, unsigned int channel_id);
+void put_channel(struct channel *channel);
+void put_message(struct message *message);
+int set_queue(struct slot *slot, struct channel *channel, unsigned int depth, unsigned int policy);
+bool has_new_message(struct channel *channel, u64 last_seq);
+bool ring_has_records(struct channel *channel);
+struct msg_slot_ring *channel_ring(struct slot *slot, struct channel *channel, unsigned long size);
+
+/*
+ * What read and write of a file set to the channel do, but for blocking, on
+ * the whole of the iov_iter. Both return the bytes read or written, or -errno.
+ */
+ssize_t read_message(struct slot *slot, struct channel *channel, struct iov_iter *to, u64 *last_seq);
+ssize_t write_message(struct slot *slot, struct channel *channel, struct iov_iter *from, bool nonblock);
+
+/*
+ * Counts the result of a read or a write in the statistics, and returns it
+ */
+ssize_t count_result(ssize_t rc, bool write);
+
+long long batch_entry(struct slot *slot, const struct msg_slot_batch_entry *entry, bool write);
+
+#endif
@@ -0,0 +1,331 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+#include "msg_store.h"
+
+/*
+ * Drives writer and reader threads over the channels of the slots, through
+ * the device files given when the module is loaded, or in-process through
+ * msg_store.c otherwise, and reports the throughput and latency of each.
+ *
+ * Latencies are kept in a log-linear histogram: exact below 16ns, then 16
+ * buckets per power of 2, so a percentile is off by at most 1/16.
+ */
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_SIZE (64 * HIST_SUB)
+
+struct options {
+    unsigned int writers, readers, channels, slots, length, seconds, depth;
+    unsigned long cap; /* store_cap, in-process */
+    char **devices; /* Of slots, or NULL for in-process */
+};
+
+struct worker {
+    pthread_t thread;
+    const struct options *opts;
+    bool write;
+    uint64_t seed;
+    int *fds; /* One per slot, in device mode */
+    uint64_t ops, empty, errors;
+    uint64_t hist[HIST_SIZE];
+};
+
+static volatile bool stop;
+
+static unsigned int hist_index(uint64_t ns) {
+    unsigned int e;
+    if (ns < HIST_SUB) return (unsigned int)ns;
+    e = 63 - (unsigned int)__builtin_clzll(ns);
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB +
+           (unsigned int)((ns >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/*
+ * Returns the least latency of the bucket of index
+ */
+static uint64_t hist_value(unsigned int index) {
+    unsigned int e;
+    if (index < HIST_SUB) return index;
+    e = index / HIST_SUB + HIST_SUB_BITS - 1;
+    return (uint64_t)(HIST_SUB + index % HIST_SUB) << (e - HIST_SUB_BITS);
+}
+
+static uint64_t hist_percentile(const uint64_t *hist, uint64_t count,
+                                double p) {
+    uint64_t rank = (uint64_t)(p * (double)count), seen = 0;
+    for (unsigned int i = 0; i < HIST_SIZE; ++i)
+        if ((seen += hist[i]) > rank) return hist_value(i);
+    return 0;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/* xorshift64 */
+static uint64_t next_random(uint64_t *seed) {
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 7;
+    *seed ^= *seed << 17;
+    return *seed;
+}
+
+/*
+ * One read or write of channel of slot, as the module's read and write
+ * return it: the bytes read or written, or -errno
+ */
+static ssize_t device_op(struct worker *w, unsigned int slot,
+                         unsigned int channel, char *buf) {
+    ssize_t rc;
+    if (ioctl(w->fds[slot], MSG_SLOT_CHANNEL, channel)) return -errno;
+    rc = w->write ? write(w->fds[slot], buf, w->opts->length)
+                  : read(w->fds[slot], buf, MSG_MAX_LEN);
+    return rc < 0 ? -errno : rc;
+}
+
+static ssize_t store_op(struct worker *w, unsigned int slot,
+                        unsigned int channel, char *buf) {
+    struct slot *s = find_slot(slot);
+    struct channel *c = find_channel(s, channel);
+    struct iov_iter iter;
+    ssize_t rc;
+    /* Created by setup, unless evicted since */
+    if (c == NULL && w->write) c = new_channel(s, channel);
+    if (c == NULL) return -EWOULDBLOCK;
+    if (IS_ERR(c)) return PTR_ERR(c);
+    import_ubuf(w->write ? ITER_SOURCE : ITER_DEST, buf,
+                w->write ? w->opts->length : MSG_MAX_LEN, &iter);
+    rc = w->write ? write_message(s, c, &iter, true)
+                  : read_message(s, c, &iter, NULL);
+    put_channel(c);
+    return rc;
+}
+
+static void *worker_main(void *arg) {
+    struct worker *w = arg;
+    const struct options *opts = w->opts;
+    char *buf = malloc(MSG_MAX_LEN);
+    uint64_t start, r;
+    ssize_t rc;
+    if (buf == NULL) {
+        perror("malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    memset(buf, 'm', MSG_MAX_LEN);
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+        r = next_random(&w->seed);
+        start = now_ns();
+        rc = opts->devices != NULL
+                 ? device_op(w, (unsigned int)(r % opts->slots),
+                             (unsigned int)((r >> 32) % opts->channels) + 1,
+                             buf)
+                 : store_op(w, (unsigned int)(r % opts->slots),
+                            (unsigned int)((r >> 32) % opts->channels) + 1,
+                            buf);
+        ++w->hist[hist_index(now_ns() - start)];
+        ++w->ops;
+        if (rc == -EWOULDBLOCK)
+            ++w->empty;
+        else if (rc < 0)
+            ++w->errors;
+    }
+    free(buf);
+    return NULL;
+}
+
+/*
+ * Opens every device of opts for the worker. Returns 0, or -1 and sets errno.
+ */
+static int open_devices(struct worker *w, const struct options *opts) {
+    w->fds = malloc(opts->slots * sizeof(int));
+    if (w->fds == NULL) return -1;
+    for (unsigned int i = 0; i < opts->slots; ++i) w->fds[i] = -1;
+    for (unsigned int i = 0; i < opts->slots; ++i)
+        if ((w->fds[i] = open(opts->devices[i], O_RDWR)) < 0) return -1;
+    return 0;
+}
+
+/*
+ * Sets every channel of every device to queued mode
+ */
+static int queue_devices(const struct worker *w, const struct options *opts) {
+    struct msg_slot_queue queue = {.depth = opts->depth,
+                                   .policy = MSG_QUEUE_DROP_OLDEST};
+    for (unsigned int i = 0; i < opts->slots; ++i)
+        for (unsigned int c = 1; c <= opts->channels; ++c)
+            if (ioctl(w->fds[i], MSG_SLOT_CHANNEL, c) ||
+                ioctl(w->fds[i], MSG_SLOT_QUEUE, &queue))
+                return -1;
+    return 0;
+}
+
+/*
+ * Creates the slots and channels of the in-process store
+ */
+static int store_setup(const struct options *opts) {
+    struct slot *slot;
+    struct channel *channel;
+    int rc;
+    if ((rc = msg_store_init())) return rc;
+    for (unsigned int i = 0; i < opts->slots; ++i) {
+        if ((rc = new_slot((unsigned char)i))) return rc;
+        slot = find_slot(i);
+        slot->quota = 0;
+        for (unsigned int c = 1; c <= opts->channels; ++c) {
+            channel = new_channel(slot, c);
+            if (IS_ERR(channel)) return (int)PTR_ERR(channel);
+            rc = opts->depth ? set_queue(slot, channel, opts->depth,
+                                         MSG_QUEUE_DROP_OLDEST)
+                             : 0;
+            put_channel(channel);
+            if (rc) return rc;
+        }
+    }
+    store_cap = opts->cap;
+    return 0;
+}
+
+static void report(const char *name, struct worker *workers,
+                   unsigned int count, double seconds) {
+    uint64_t hist[HIST_SIZE] = {0}, ops = 0, empty = 0, errors = 0;
+    if (count == 0) return;
+    for (unsigned int i = 0; i < count; ++i) {
+        ops += workers[i].ops;
+        empty += workers[i].empty;
+        errors += workers[i].errors;
+        for (unsigned int j = 0; j < HIST_SIZE; ++j)
+            hist[j] += workers[i].hist[j];
+    }
+    printf("%-7s %12.0f ops/s  p50 %8lu ns  p99 %8lu ns", name,
+           (double)ops / seconds,
+           (unsigned long)hist_percentile(hist, ops, 0.50),
+           (unsigned long)hist_percentile(hist, ops, 0.99));
+    if (empty) printf("  %.1f%% empty", 100.0 * (double)empty / (double)ops);
+    if (errors) printf("  %lu errors", (unsigned long)errors);
+    putchar('\n');
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-w writers] [-r readers] [-c channels] [-s slots] "
+            "[-l length] [-d seconds] [-q depth] [-m cap] [device...]\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    struct options opts = {.writers = 1, .readers = 1, .channels = 1,
+                           .slots = 1, .length = 64, .seconds = 3};
+    unsigned int nworkers, i;
+    struct worker *workers;
+    struct msg_stats stats;
+    uint64_t start;
+    double seconds;
+    int opt, rc;
+    while ((opt = getopt(argc, argv, "w:r:c:s:l:d:q:m:")) != -1) {
+        unsigned int value = (unsigned int)strtoul(optarg, NULL, 10);
+        switch (opt) {
+        case 'w': opts.writers = value; break;
+        case 'r': opts.readers = value; break;
+        case 'c': opts.channels = value; break;
+        case 's': opts.slots = value; break;
+        case 'l': opts.length = value; break;
+        case 'd': opts.seconds = value; break;
+        case 'q': opts.depth = value; break;
+        case 'm': opts.cap = strtoul(optarg, NULL, 10); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind < argc) {
+        opts.devices = &argv[optind];
+        opts.slots = (unsigned int)(argc - optind);
+    }
+    if (opts.channels == 0 || opts.slots == 0 || opts.slots > SLOTS_NUM ||
+        opts.length == 0 || opts.length > MSG_MAX_LEN ||
+        opts.depth > MSG_QUEUE_MAX_DEPTH || opts.writers + opts.readers == 0)
+        usage(argv[0]);
+    nworkers = opts.writers + opts.readers;
+    workers = calloc(nworkers, sizeof(struct worker));
+    if (workers == NULL) {
+        perror("calloc failed");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < nworkers; ++i) {
+        workers[i].opts = &opts;
+        workers[i].write = i < opts.writers;
+        workers[i].seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+        if (opts.devices != NULL && open_devices(&workers[i], &opts) < 0) {
+            /* Without the module, measure the store in-process instead */
+            if (errno != ENOENT && errno != ENODEV && errno != ENXIO) {
+                perror("open failed");
+                exit(EXIT_FAILURE);
+            }
+            fprintf(stderr, "%s: module not loaded, running in-process\n",
+                    argv[0]);
+            opts.devices = NULL;
+        }
+    }
+    if (opts.devices != NULL && opts.depth &&
+        queue_devices(&workers[0], &opts) < 0) {
+        perror("ioctl failed");
+        exit(EXIT_FAILURE);
+    }
+    if (opts.devices == NULL && (rc = store_setup(&opts))) {
+        errno = -rc;
+        perror("setup failed");
+        exit(EXIT_FAILURE);
+    }
+    start = now_ns();
+    for (i = 0; i < nworkers; ++i)
+        if ((rc = pthread_create(&workers[i].thread, NULL, worker_main,
+                                 &workers[i]))) {
+            errno = rc;
+            perror("pthread_create failed");
+            exit(EXIT_FAILURE);
+        }
+    /* In-process, main reclaims as the module's reclaimer does */
+    while (now_ns() - start < opts.seconds * 1000000000ULL) {
+        usleep(100000);
+        if (opts.devices == NULL) msg_store_reclaim();
+    }
+    __atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+    for (i = 0; i < nworkers; ++i) pthread_join(workers[i].thread, NULL);
+    seconds = (double)(now_ns() - start) / 1e9;
+    printf("%s: %u writers, %u readers, %u channels, %u slots, %u bytes%s\n",
+           opts.devices != NULL ? "device" : "in-process", opts.writers,
+           opts.readers, opts.channels, opts.slots, opts.length,
+           opts.depth ? ", queued" : "");
+    report("write", workers, opts.writers, seconds);
+    report("read", workers + opts.writers, opts.readers, seconds);
+    if (opts.devices == NULL) {
+        msg_store_stats(&stats);
+        if (stats.evicted_idle + stats.evicted_lru)
+            printf("evicted %llu channels, %ld bytes held\n",
+                   (unsigned long long)(stats.evicted_idle + stats.evicted_lru),
+                   msg_store_bytes());
+        msg_store_exit();
+    }
+    for (i = 0; i < nworkers; ++i) {
+        if (workers[i].fds != NULL)
+            for (unsigned int s = 0; s < opts.slots; ++s)
+                if (workers[i].fds[s] >= 0) close(workers[i].fds[s]);
+        free(workers[i].fds);
+    }
+    free(workers);
+    return EXIT_SUCCESS;
+}
@@ -8,4 +8,12 @@ void* phys_to_virt(uint64_t phys_addr);
 void page_table_update(uint64_t pt, uint64_t vpn, uint64_t ppn);
 uint64_t page_table_query(uint64_t pt, uint64_t vpn);
 
+/* page_table_query answers from a TLB when it can, walking the table on a miss */
+struct tlb_stats {
+	uint64_t hits;
+	uint64_t misses;
+};
+
+void page_table_tlb_stats(struct tlb_stats *stats);
+
 
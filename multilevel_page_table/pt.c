@@ -5,15 +5,47 @@
 #define NLEVELS 5 /* (45 bit page address )/(9 bit page address space per level) = 5 levels  */
 #define VLD_MSK 1 /* valid bit mask*/
 #define OFF_SIZE 12
+#define TLB_SIZE 256 /* Direct-mapped, indexed by the low bits of vpn ^ pt */
+#define TLB_MSK (TLB_SIZE - 1)
+
+/* A cached translation of vpn in page table pt, NO_MAPPING included */
+struct tlb_entry {
+    uint64_t pt;
+    uint64_t vpn;
+    uint64_t ppn;
+    _Bool valid;
+};
+
+static struct tlb_entry tlb[TLB_SIZE];
+static struct tlb_stats tlb_stats;
+
+/* The same vpn of different page tables lands in different entries */
+static struct tlb_entry *tlb_entry_of(uint64_t pt, uint64_t vpn) {
+    return &tlb[(vpn ^ pt) & TLB_MSK];
+}
+
+/* Drops the cached translation of vpn in pt, if any */
+static void tlb_invalidate(uint64_t pt, uint64_t vpn) {
+    struct tlb_entry *entry = tlb_entry_of(pt, vpn);
+    if (entry->valid && entry->vpn == vpn && entry->pt == pt)
+        entry->valid = 0;
+}
+
+void page_table_tlb_stats(struct tlb_stats *stats) {
+    *stats = tlb_stats;
+}
 
 void page_table_update(uint64_t pt, uint64_t vpn, uint64_t ppn) {
     _Bool valid;
     int i = NLEVELS - 1;
     uint64_t vpn_part_for_level;
     uint64_t *current_table = phys_to_virt(pt << OFF_SIZE);
+    tlb_invalidate(pt, vpn);
     if (ppn == NO_MAPPING) {
         for (; i >= 0; --i) {
             vpn_part_for_level = (vpn >> i * TABLE_ADDR_SIZE) & TABLE_ADDR_MSK;
+            if (!(current_table[vpn_part_for_level] & VLD_MSK))
+                return; /* never mapped */
             if (i == 0)
                 current_table[vpn_part_for_level] &= ~VLD_MSK; /* invalidate the PTE on the last level */
             else
@@ -35,7 +67,7 @@ void page_table_update(uint64_t pt, uint64_t vpn, uint64_t ppn) {
     }
 }
 
-uint64_t page_table_query(uint64_t pt, uint64_t vpn) {
+static uint64_t page_table_walk(uint64_t pt, uint64_t vpn) {
     _Bool valid;
     int i = NLEVELS - 1;
     uint64_t vpn_part_for_level, current_pte;
@@ -52,3 +84,17 @@ uint64_t page_table_query(uint64_t pt, uint64_t vpn) {
     }
     return -1; /* should never get here */
 }
+
+uint64_t page_table_query(uint64_t pt, uint64_t vpn) {
+    struct tlb_entry *entry = tlb_entry_of(pt, vpn);
+    if (entry->valid && entry->vpn == vpn && entry->pt == pt) {
+        ++tlb_stats.hits;
+        return entry->ppn;
+    }
+    ++tlb_stats.misses;
+    entry->pt = pt;
+    entry->vpn = vpn;
+    entry->ppn = page_table_walk(pt, vpn);
+    entry->valid = 1;
+    return entry->ppn;
+}
@@ -73,8 +73,62 @@ void perform_random_move(uint64_t pt) {
 	update_and_check(pt, vpn, ppn);
 }
 
+/* Asserts the TLB hit and missed this many times since before */
+void check_tlb_stats(const struct tlb_stats *before, uint64_t hits, uint64_t misses) {
+	struct tlb_stats after;
+	page_table_tlb_stats(&after);
+	assert(after.hits - before->hits == hits);
+	assert(after.misses - before->misses == misses);
+}
+
+/* No query answers with a translation that an update since replaced */
+void test_tlb(void) {
+	uint64_t pt = alloc_page_frame();
+	uint64_t other_pt = alloc_page_frame();
+	uint64_t vpn = 0xcafe, unmapped_vpn = 0x1234567890, frame;
+	struct tlb_stats stats;
+
+	page_table_tlb_stats(&stats);
+	page_table_update(pt, vpn, 0xf00d);
+	assert(page_table_query(pt, vpn) == 0xf00d);
+	assert(page_table_query(pt, vpn) == 0xf00d);
+	check_tlb_stats(&stats, 1, 1);
+
+	/* Remapped to another ppn */
+	page_table_tlb_stats(&stats);
+	page_table_update(pt, vpn, 0xbeef);
+	assert(page_table_query(pt, vpn) == 0xbeef);
+	assert(page_table_query(pt, vpn) == 0xbeef);
+	check_tlb_stats(&stats, 1, 1);
+
+	/* The same vpn in another page table */
+	assert(page_table_query(other_pt, vpn) == NO_MAPPING);
+	assert(page_table_query(pt, vpn) == 0xbeef);
+
+	/* Unmapped, NO_MAPPING is cached too */
+	page_table_tlb_stats(&stats);
+	page_table_update(pt, vpn, NO_MAPPING);
+	assert(page_table_query(pt, vpn) == NO_MAPPING);
+	assert(page_table_query(pt, vpn) == NO_MAPPING);
+	check_tlb_stats(&stats, 1, 1);
+
+	/* Unmapping a vpn never mapped allocates no table, and still invalidates */
+	page_table_tlb_stats(&stats);
+	assert(page_table_query(pt, unmapped_vpn) == NO_MAPPING);
+	frame = alloc_page_frame();
+	page_table_update(pt, unmapped_vpn, NO_MAPPING);
+	assert(alloc_page_frame() == frame + 1);
+	assert(page_table_query(pt, unmapped_vpn) == NO_MAPPING);
+	check_tlb_stats(&stats, 0, 2);
+
+	/* Mapped after NO_MAPPING was cached for it */
+	page_table_update(pt, unmapped_vpn, 0xd00d);
+	assert(page_table_query(pt, unmapped_vpn) == 0xd00d);
+}
+
 int main(int argc, char **argv)
 {
+    test_tlb();
     int a;
     int b;
     int c;
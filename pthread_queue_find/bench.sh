@@ -0,0 +1,65 @@
+#!/bin/bash
+# Benchmarks pfind on synthetic trees built by gentree in tmpfs, so that the
+# disk stays out of the numbers. For every shape, engine and thread count it
+# reports the best of RUNS runs in entries (files and directories) per second,
+# the time the threads waited for the deque locks and slept for work in that
+# run, from pfind --stats, and, under strace, the system calls per entry.
+# The environment overrides the defaults below, for instance:
+#   FILES=1000000 THREADS="1 16" SHAPES=wide ./bench.sh
+set -e
+cd "$(dirname "$0")"
+
+FILES=${FILES:-200000}
+SHAPES=${SHAPES:-"deep wide balanced skewed"}
+ENGINES=${ENGINES:-"sync uring"}
+THREADS=${THREADS:-"1 2 4 8"}
+RUNS=${RUNS:-3}
+SEED=${SEED:-1}
+SEARCH=${SEARCH:-foo}
+BENCH_DIR=${BENCH_DIR:-/dev/shm/pfind_bench}
+[ -d "$(dirname "$BENCH_DIR")" ] || BENCH_DIR=/tmp/pfind_bench
+
+now_ns() { date +%s%N; }
+
+# Prints the system calls of a run under strace
+trace_run() {
+    strace -f -c -o "$BENCH_DIR/strace.out" ./pfind "$@" >/dev/null 2>&1
+    awk '$NF == "total" { print $4 }' "$BENCH_DIR/strace.out"
+}
+
+mkdir -p "$BENCH_DIR"
+printf "%-9s %-6s %7s %12s %13s %10s %14s\n" shape engine threads \
+    entries/s "lock wait ms" "asleep ms" syscalls/entry
+for shape in $SHAPES; do
+    root="$BENCH_DIR/$shape"
+    rm -rf "$root"
+    entries=$(./gentree "$shape" "$root" "$FILES" "$SEED")
+    for engine in $ENGINES; do
+        for threads in $THREADS; do
+            best=
+            for _ in $(seq "$RUNS"); do
+                start=$(now_ns)
+                ./pfind --stats --engine "$engine" "$root" "$SEARCH" \
+                    "$threads" >/dev/null 2>"$BENCH_DIR/stats.out"
+                elapsed=$(($(now_ns) - start))
+                if [ -z "$best" ] || [ "$elapsed" -lt "$best" ]; then
+                    best=$elapsed
+                    # The totals row: thread dirs entries asleep lock_wait
+                    read -r _ _ _ asleep lock_wait _ < <(grep '^ *total ' \
+                        "$BENCH_DIR/stats.out")
+                fi
+            done
+            rate=$((entries * 1000000000 / best))
+            per_entry=-
+            if command -v strace >/dev/null; then
+                calls=$(trace_run --engine "$engine" "$root" "$SEARCH" \
+                    "$threads")
+                per_entry=$(awk -v c="$calls" -v e="$entries" \
+                    'BEGIN { printf "%.2f", c / e }')
+            fi
+            printf "%-9s %-6s %7s %12s %13s %10s %14s\n" "$shape" "$engine" \
+                "$threads" "$rate" "$lock_wait" "$asleep" "$per_entry"
+        done
+    done
+    rm -rf "$root"
+done
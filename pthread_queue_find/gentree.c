@@ -0,0 +1,168 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FILES_PER_DIR 8 /* Files put in a directory before its children */
+#define FANOUT 8        /* Children of a directory in the tree shapes */
+/*
+ * Of the deep shape's chain. Its paths grow past PATH_MAX on purpose, about
+ * 5000 bytes at the bottom, so that pfind opens the deepest directories
+ * relative to an ancestor rather than by path.
+ */
+#define MAX_DEPTH 512
+#define NAME_SIZE 64
+
+/*
+ * Builds a synthetic directory tree for benchmarking pfind. The same shape,
+ * size and seed always build the same tree:
+ * deep      a chain of directories, the files spread along it
+ * wide      a single level of small directories under the root
+ * balanced  a tree of FANOUT children per directory, equally filled
+ * skewed    a tree where the first child of every directory gets half of
+ *           what is left, so one subtree holds most of the files
+ * The file names are drawn from a few words, so that searching for one of
+ * them matches a known share of the files.
+ */
+
+enum shape { SHAPE_DEEP, SHAPE_WIDE, SHAPE_BALANCED, SHAPE_SKEWED };
+
+static const char *const shape_names[] = {"deep", "wide", "balanced",
+                                          "skewed"};
+static const char *const words[] = {"foo",  "bar", "baz",    "qux",
+                                    "data", "log", "report", "image"};
+static const char *const extensions[] = {".c", ".h", ".txt", ".log", ""};
+
+static uint64_t rng_state;
+static unsigned long entries;
+
+static uint64_t next_random(void) { /* xorshift64 */
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+#define PICK(array)                                                            \
+    ((array)[next_random() % (sizeof(array) / sizeof(*(array)))])
+
+void create_file(int dir_fd, unsigned long i) {
+    char name[NAME_SIZE];
+    int fd;
+    snprintf(name, sizeof(name), "%s_%lu%s", PICK(words), i, PICK(extensions));
+    if ((fd = openat(dir_fd, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                     0644)) < 0) {
+        perror("openat failed");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    ++entries;
+}
+
+/*
+ * Creates the directory number i in dir_fd and returns its fd
+ */
+int create_dir(int dir_fd, unsigned long i) {
+    char name[NAME_SIZE];
+    int fd;
+    snprintf(name, sizeof(name), "%s_dir%lu", PICK(words), i);
+    if (mkdirat(dir_fd, name, 0755) < 0) {
+        perror("mkdirat failed");
+        exit(EXIT_FAILURE);
+    }
+    if ((fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        perror("openat failed");
+        exit(EXIT_FAILURE);
+    }
+    ++entries;
+    return fd;
+}
+
+/*
+ * Puts nfiles files in the directory dir_fd and under it, depth levels down
+ */
+void fill(int dir_fd, unsigned long nfiles, enum shape shape,
+          unsigned int depth) {
+    unsigned long here = FILES_PER_DIR, left, share;
+    unsigned int children;
+    int child_fd;
+    /* The chain ends MAX_DEPTH levels down at most */
+    if (shape == SHAPE_DEEP && nfiles / (MAX_DEPTH - depth) > here)
+        here = nfiles / (MAX_DEPTH - depth);
+    if (shape == SHAPE_WIDE && depth == 0) here = 0;
+    if (here > nfiles) here = nfiles;
+    for (unsigned long i = 0; i < here; ++i) create_file(dir_fd, i);
+    left = nfiles - here;
+    if (!left) return;
+    switch (shape) {
+    case SHAPE_DEEP:
+        child_fd = create_dir(dir_fd, 0);
+        fill(child_fd, left, shape, depth + 1);
+        close(child_fd);
+        return;
+    case SHAPE_WIDE:
+        for (unsigned long i = 0; left; ++i) {
+            share = left < FILES_PER_DIR ? left : FILES_PER_DIR;
+            child_fd = create_dir(dir_fd, i);
+            fill(child_fd, share, shape, depth + 1);
+            close(child_fd);
+            left -= share;
+        }
+        return;
+    case SHAPE_BALANCED:
+    case SHAPE_SKEWED:
+        children = left < FANOUT ? (unsigned int)left : FANOUT;
+        for (unsigned int i = 0; i < children; ++i) {
+            if (shape == SHAPE_SKEWED && i == 0 && children > 1)
+                share = left / 2;
+            else
+                share = left / (children - i);
+            child_fd = create_dir(dir_fd, i);
+            fill(child_fd, share, shape, depth + 1);
+            close(child_fd);
+            left -= share;
+        }
+        return;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    enum shape shape;
+    unsigned long nfiles;
+    char *end;
+    int root_fd;
+    if (argc < 4 || argc > 5) {
+        fprintf(stderr,
+                "usage: %s deep|wide|balanced|skewed ROOT FILES [SEED]\n",
+                argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    for (shape = 0; shape <= SHAPE_SKEWED; ++shape)
+        if (!strcmp(argv[1], shape_names[shape])) break;
+    errno = 0;
+    nfiles = strtoul(argv[3], &end, 10);
+    rng_state = argc == 5 ? strtoull(argv[4], NULL, 10) : 1;
+    if (shape > SHAPE_SKEWED || errno || *end || !rng_state) {
+        errno = EINVAL;
+        perror("invalid shape, file count or seed");
+        exit(EXIT_FAILURE);
+    }
+    if (mkdir(argv[2], 0755) < 0) {
+        perror("mkdir failed");
+        exit(EXIT_FAILURE);
+    }
+    if ((root_fd = open(argv[2], O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        perror("open failed");
+        exit(EXIT_FAILURE);
+    }
+    fill(root_fd, nfiles, shape, 0);
+    close(root_fd);
+    printf("%lu\n", entries); /* For the bench script's rates */
+    exit(EXIT_SUCCESS);
+}
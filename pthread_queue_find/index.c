@@ -0,0 +1,159 @@
+#define _GNU_SOURCE
+
+#include "index.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define INDEX_MAGIC "PFINDIX1"
+#define PAD8(n) (((n) + 7) & ~(uint64_t)7)
+
+/*
+ * Checks that every offset and count stays within the file, that names are
+ * ended, and that subdirectories come after their parents, so that walking
+ * the index always ends
+ */
+static int index_check(struct index *idx, const struct index_header *header,
+                       uint64_t names_offset) {
+    const struct index_dir *dir;
+    const struct index_entry *entry;
+    if (names_offset + header->names_size != idx->size ||
+        (header->names_size && idx->names[header->names_size - 1]) ||
+        !header->ndirs)
+        return -1;
+    for (uint32_t i = 0; i < header->ndirs; ++i) {
+        dir = &idx->dirs[i];
+        if (dir->first_entry > header->nentries ||
+            dir->nentries > header->nentries - dir->first_entry)
+            return -1;
+        for (uint64_t j = 0; j < dir->nentries; ++j) {
+            entry = &idx->entries[dir->first_entry + j];
+            if (entry->name >= header->names_size ||
+                (entry->dir != INDEX_NO_DIR &&
+                 (entry->dir <= i || entry->dir >= header->ndirs)))
+                return -1;
+        }
+    }
+    return 0;
+}
+
+int index_open(struct index *idx, const char *path, const char *root) {
+    struct stat st;
+    const struct index_header *header;
+    uint64_t dirs_offset, entries_offset, names_offset;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    *idx = (struct index){.map = MAP_FAILED};
+    if (fd < 0) return -1;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*header)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    idx->size = (size_t)st.st_size;
+    idx->map = mmap(NULL, idx->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (idx->map == MAP_FAILED) return -1;
+    header = idx->map;
+    dirs_offset = PAD8(sizeof(*header) + (uint64_t)header->root_len + 1);
+    entries_offset = dirs_offset + header->ndirs * sizeof(struct index_dir);
+    names_offset = entries_offset +
+                   header->nentries * sizeof(struct index_entry);
+    if (memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) ||
+        header->nentries > idx->size / sizeof(struct index_entry) ||
+        names_offset > idx->size ||
+        strlen(root) != header->root_len ||
+        memcmp((char *)(header + 1), root, header->root_len + 1)) {
+        index_close(idx);
+        errno = EINVAL;
+        return -1;
+    }
+    idx->ndirs = header->ndirs;
+    idx->dirs = (const struct index_dir *)((char *)idx->map + dirs_offset);
+    idx->entries =
+        (const struct index_entry *)((char *)idx->map + entries_offset);
+    idx->names = (const char *)idx->map + names_offset;
+    if (index_check(idx, header, names_offset) < 0) {
+        index_close(idx);
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+void index_close(struct index *idx) {
+    if (idx->map != MAP_FAILED) munmap(idx->map, idx->size);
+    idx->map = MAP_FAILED;
+    idx->ndirs = 0;
+}
+
+uint32_t index_find(const struct index *idx, uint32_t dir, const char *name) {
+    const struct index_entry *entries;
+    size_t low = 0, high, mid;
+    int cmp;
+    if (dir >= idx->ndirs) return INDEX_NO_DIR;
+    entries = &idx->entries[idx->dirs[dir].first_entry];
+    high = idx->dirs[dir].nentries;
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        if (!(cmp = strcmp(name, idx->names + entries[mid].name)))
+            return entries[mid].type == DT_DIR ? entries[mid].dir
+                                               : INDEX_NO_DIR;
+        if (cmp < 0)
+            high = mid;
+        else
+            low = mid + 1;
+    }
+    return INDEX_NO_DIR;
+}
+
+static bool write_padded(FILE *file, const void *buf, size_t size) {
+    static const char zeros[8];
+    return fwrite(buf, 1, size, file) == size &&
+           fwrite(zeros, 1, PAD8(size) - size, file) == PAD8(size) - size;
+}
+
+int index_write(const char *path, const char *root,
+                const struct index_dir *dirs, uint32_t ndirs,
+                const struct index_entry *entries, uint64_t nentries,
+                const char *names, uint64_t names_size) {
+    struct index_header header = {.magic = INDEX_MAGIC,
+                                  .ndirs = ndirs,
+                                  .root_len = (uint32_t)strlen(root),
+                                  .nentries = nentries,
+                                  .names_size = names_size};
+    size_t tmp_len = strlen(path) + sizeof(".tmp");
+    char *tmp = malloc(tmp_len);
+    FILE *file;
+    bool ok;
+    int saved_errno;
+    if (tmp == NULL) return -1;
+    snprintf(tmp, tmp_len, "%s.tmp", path);
+    if ((file = fopen(tmp, "we")) == NULL) {
+        free(tmp);
+        return -1;
+    }
+    ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+         write_padded(file, root, header.root_len + 1) &&
+         fwrite(dirs, sizeof(*dirs), ndirs, file) == ndirs &&
+         fwrite(entries, sizeof(*entries), nentries, file) == nentries &&
+         fwrite(names, 1, names_size, file) == names_size &&
+         fflush(file) == 0 && fsync(fileno(file)) == 0;
+    if (fclose(file) != 0) ok = false;
+    if (ok && rename(tmp, path) == 0) {
+        free(tmp);
+        return 0;
+    }
+    saved_errno = errno;
+    unlink(tmp);
+    free(tmp);
+    errno = saved_errno;
+    return -1;
+}
@@ -0,0 +1,73 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define INDEX_NO_DIR UINT32_MAX /* The dir of an entry that is not one */
+
+/*
+ * An index of a directory tree, as written by a previous search: the
+ * directories, each with its mtime and its entries sorted by name, and each
+ * entry with its type and, for a subdirectory, its own directory record. The
+ * search root is directory 0, and a subdirectory always comes after its
+ * parent. The file is mapped as is, and checked to be consistent when opened.
+ *
+ * Layout: the header, the search root's path padded to 8 bytes, the dirs, the
+ * entries, then the names, each ended by '\0'.
+ */
+struct index_header {
+    char magic[8];
+    uint32_t ndirs;
+    uint32_t root_len;
+    uint64_t nentries;
+    uint64_t names_size;
+};
+
+struct index_dir {
+    int64_t mtime_sec;
+    uint32_t mtime_nsec;
+    uint32_t nentries;
+    uint64_t first_entry;
+};
+
+struct index_entry {
+    uint64_t name; /* Offset in the names */
+    uint32_t dir;  /* Of a subdirectory, or INDEX_NO_DIR */
+    uint8_t type;  /* DT_* */
+    uint8_t pad[3];
+};
+
+struct index {
+    void *map;
+    size_t size;
+    uint32_t ndirs;
+    const struct index_dir *dirs;
+    const struct index_entry *entries;
+    const char *names;
+};
+
+/*
+ * Maps the index at path, if it is one of the search root root. Returns 0, or
+ * -1 and sets errno, to EINVAL for a file that is not such an index.
+ */
+int index_open(struct index *idx, const char *path, const char *root);
+
+void index_close(struct index *idx);
+
+/*
+ * Returns the directory record of the subdirectory name of the directory dir,
+ * or INDEX_NO_DIR
+ */
+uint32_t index_find(const struct index *idx, uint32_t dir, const char *name);
+
+/*
+ * Writes an index to path atomically, by renaming a complete temporary file
+ * over it. Returns 0, or -1 and sets errno.
+ */
+int index_write(const char *path, const char *root,
+                const struct index_dir *dirs, uint32_t ndirs,
+                const struct index_entry *entries, uint64_t nentries,
+                const char *names, uint64_t names_size);
+
+#endif
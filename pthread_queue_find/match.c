@@ -0,0 +1,148 @@
+#define _GNU_SOURCE
+
+#include "match.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ACCEPT 0x80000000u /* Set on transitions into an accepting state */
+
+static unsigned char fold(unsigned char c, int flags) {
+    return flags & MATCH_IGNORE_CASE ? (unsigned char)tolower(c) : c;
+}
+
+/*
+ * Numbers the bytes the patterns are made of, so the automaton has a column
+ * per class rather than per byte. Letters share a class with their other case
+ * when ignoring case. There are at most 255 classes besides 0, as '\0' is in
+ * no pattern.
+ */
+static void build_classes(struct matcher *m, char **patterns,
+                          size_t npatterns) {
+    unsigned char c;
+    memset(m->classes, 0, sizeof(m->classes));
+    m->nclasses = 1;
+    for (size_t i = 0; i < npatterns; ++i)
+        for (unsigned char *p = (unsigned char *)patterns[i]; *p; ++p) {
+            c = fold(*p, m->flags);
+            if (m->classes[c]) continue;
+            m->classes[c] = (unsigned char)m->nclasses++;
+            if (m->flags & MATCH_IGNORE_CASE)
+                m->classes[toupper(c)] = m->classes[c];
+        }
+}
+
+/*
+ * Builds the trie of the patterns, then completes it into a DFA in BFS order:
+ * a missing transition of a state is its failure state's transition, and a
+ * state accepts if its failure state does. The transitions are finally stored
+ * as row offsets, with ACCEPT set on those into accepting states, as a match
+ * ends the scan of a name.
+ */
+static int build_automaton(struct matcher *m, char **patterns,
+                           size_t npatterns) {
+    size_t total = 1, nstates = 1, head = 0, tail = 0, i;
+    uint32_t s, t, *go, *fail, *queue;
+    unsigned int nc;
+    bool *accepting;
+    for (i = 0; i < npatterns; ++i) total += strlen(patterns[i]);
+    build_classes(m, patterns, npatterns);
+    nc = m->nclasses;
+    if (total > (ACCEPT - 1) / nc) {
+        errno = EOVERFLOW;
+        return -1;
+    }
+    go = calloc(total * nc, sizeof(uint32_t));
+    fail = malloc(total * sizeof(uint32_t));
+    queue = malloc(total * sizeof(uint32_t));
+    accepting = calloc(total, sizeof(bool));
+    if (go == NULL || fail == NULL || queue == NULL || accepting == NULL) {
+        free(go);
+        free(fail);
+        free(queue);
+        free(accepting);
+        return -1;
+    }
+    for (i = 0; i < npatterns; ++i) {
+        s = 0;
+        for (unsigned char *p = (unsigned char *)patterns[i]; *p; ++p) {
+            uint32_t *next = &go[s * nc + m->classes[fold(*p, m->flags)]];
+            if (!*next) *next = (uint32_t)nstates++;
+            s = *next;
+        }
+        accepting[s] = true;
+    }
+    for (unsigned int c = 0; c < nc; ++c)
+        if ((t = go[c])) {
+            fail[t] = 0;
+            queue[tail++] = t;
+        }
+    while (head < tail) {
+        s = queue[head++];
+        accepting[s] |= accepting[fail[s]];
+        for (unsigned int c = 0; c < nc; ++c) {
+            if ((t = go[s * nc + c])) {
+                fail[t] = go[fail[s] * nc + c];
+                queue[tail++] = t;
+            } else {
+                go[s * nc + c] = go[fail[s] * nc + c];
+            }
+        }
+    }
+    for (i = 0; i < nstates * nc; ++i)
+        go[i] = go[i] * nc | (accepting[go[i]] ? ACCEPT : 0);
+    m->delta = go;
+    free(fail);
+    free(queue);
+    free(accepting);
+    return 0;
+}
+
+int matcher_init(struct matcher *m, char **patterns, size_t npatterns,
+                 int flags) {
+    *m = (struct matcher){.flags = flags};
+    if (flags & MATCH_GLOB) { /* The patterns must outlive the matcher */
+        m->globs = patterns;
+        m->nglobs = npatterns;
+        return 0;
+    }
+    for (size_t i = 0; i < npatterns; ++i)
+        if (!*patterns[i]) {
+            m->match_all = true;
+            return 0;
+        }
+    if (npatterns == 1 && !(flags & MATCH_IGNORE_CASE)) {
+        m->term = patterns[0];
+        return 0;
+    }
+    return build_automaton(m, patterns, npatterns);
+}
+
+static bool match_automaton(const struct matcher *m, const char *name) {
+    uint32_t s = 0;
+    for (const unsigned char *p = (const unsigned char *)name; *p; ++p)
+        if ((s = m->delta[s + m->classes[*p]]) & ACCEPT) return true;
+    return false;
+}
+
+static bool match_globs(const struct matcher *m, const char *name) {
+    int flags = m->flags & MATCH_IGNORE_CASE ? FNM_CASEFOLD : 0;
+    for (size_t i = 0; i < m->nglobs; ++i)
+        if (!fnmatch(m->globs[i], name, flags)) return true;
+    return false;
+}
+
+bool matcher_match(const struct matcher *m, const char *name) {
+    if (m->match_all) return true;
+    if (m->flags & MATCH_GLOB) return match_globs(m, name);
+    if (m->delta != NULL) return match_automaton(m, name);
+    return strstr(name, m->term) != NULL;
+}
+
+void matcher_free(struct matcher *m) {
+    free(m->delta);
+    m->delta = NULL;
+}
@@ -0,0 +1,41 @@
+#ifndef MATCH_H
+#define MATCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define MATCH_IGNORE_CASE 1 /* ASCII letters match either case */
+#define MATCH_GLOB 2        /* Patterns are globs on the whole file name */
+
+/*
+ * Matches file names against a set of patterns, in one of three ways:
+ * - A single case sensitive substring, with strstr, which libc vectorizes.
+ * - Any number of substrings, with an Aho-Corasick automaton, so every name
+ *   is scanned once whatever the number of patterns.
+ * - Globs, with fnmatch, one pattern after another.
+ */
+struct matcher {
+    int flags;
+    bool match_all; /* An empty substring is in every name */
+    char *term;     /* Single substring */
+    /* Aho-Corasick, as a DFA over the byte classes of the patterns */
+    unsigned char classes[256]; /* Bytes in no pattern are class 0 */
+    unsigned int nclasses;
+    uint32_t *delta; /* Rows of nclasses transitions per state */
+    /* Globs */
+    char **globs;
+    size_t nglobs;
+};
+
+/*
+ * Builds a matcher for npatterns patterns. Returns 0, or -1 and sets errno.
+ */
+int matcher_init(struct matcher *m, char **patterns, size_t npatterns,
+                 int flags);
+
+bool matcher_match(const struct matcher *m, const char *name);
+
+void matcher_free(struct matcher *m);
+
+#endif
@@ -0,0 +1,75 @@
+#include "mpmc.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+int mpmc_init(struct mpmc_ring *ring, size_t size) {
+    if (!size || (size & (size - 1))) {
+        errno = EINVAL;
+        return -1;
+    }
+    if ((ring->cells = malloc(size * sizeof(struct mpmc_cell))) == NULL)
+        return -1;
+    for (size_t i = 0; i < size; ++i) atomic_init(&ring->cells[i].seq, i);
+    ring->mask = size - 1;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    return 0;
+}
+
+void mpmc_free(struct mpmc_ring *ring) {
+    free(ring->cells);
+    ring->cells = NULL;
+}
+
+bool mpmc_push(struct mpmc_ring *ring, void *item) {
+    struct mpmc_cell *cell;
+    size_t pos = atomic_load_explicit(&ring->tail, memory_order_relaxed), seq;
+    intptr_t dif;
+    while (true) {
+        cell = &ring->cells[pos & ring->mask];
+        seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        dif = (intptr_t)seq - (intptr_t)pos;
+        if (!dif) {
+            if (atomic_compare_exchange_weak_explicit(
+                    &ring->tail, &pos, pos + 1, memory_order_relaxed,
+                    memory_order_relaxed))
+                break;
+        } else if (dif < 0) {
+            return false; /* The cell still holds the item of a lap ago */
+        } else {
+            pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        }
+    }
+    cell->item = item;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+    return true;
+}
+
+void *mpmc_pop(struct mpmc_ring *ring) {
+    struct mpmc_cell *cell;
+    size_t pos = atomic_load_explicit(&ring->head, memory_order_relaxed), seq;
+    intptr_t dif;
+    void *item;
+    while (true) {
+        cell = &ring->cells[pos & ring->mask];
+        seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        dif = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (!dif) {
+            if (atomic_compare_exchange_weak_explicit(
+                    &ring->head, &pos, pos + 1, memory_order_relaxed,
+                    memory_order_relaxed))
+                break;
+        } else if (dif < 0) {
+            return NULL; /* Nothing pushed at pos yet */
+        } else {
+            pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        }
+    }
+    item = cell->item;
+    /* Ready for the push of pos one lap later */
+    atomic_store_explicit(&cell->seq, pos + ring->mask + 1,
+                          memory_order_release);
+    return item;
+}
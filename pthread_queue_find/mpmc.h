@@ -0,0 +1,43 @@
+#ifndef MPMC_H
+#define MPMC_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * A bounded lock-free multi-producer multi-consumer FIFO of pointers, after
+ * Dmitry Vyukov's: each cell has a sequence number telling whether it is
+ * ready for the producer or the consumer of position pos, so claiming a
+ * position takes a single CAS on head or tail and no cell is ever reclaimed.
+ */
+struct mpmc_cell {
+    atomic_size_t seq;
+    void *item;
+};
+
+struct mpmc_ring {
+    struct mpmc_cell *cells;
+    size_t mask; /* Size - 1, the size being a power of 2 */
+    _Alignas(64) atomic_size_t head; /* Next position to pop */
+    _Alignas(64) atomic_size_t tail; /* Next position to push */
+};
+
+/*
+ * Returns 0, or -1 and sets errno
+ */
+int mpmc_init(struct mpmc_ring *ring, size_t size);
+
+void mpmc_free(struct mpmc_ring *ring);
+
+/*
+ * Returns false if the ring is full
+ */
+bool mpmc_push(struct mpmc_ring *ring, void *item);
+
+/*
+ * Returns NULL if the ring is empty
+ */
+void *mpmc_pop(struct mpmc_ring *ring);
+
+#endif
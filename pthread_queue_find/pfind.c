@@ -1,62 +1,404 @@
+#define _GNU_SOURCE
+
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/queue.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#ifdef PFIND_QUEUE_MPMC
+#include <linux/futex.h>
+#endif
+#include <unistd.h>
+
+#include "index.h"
+#include "match.h"
+#include "mpmc.h"
+#include "pred.h"
+#include "topology.h"
+#include "uring.h"
+
+#define ARG_NUM 3 /* Positional arguments */
+#define ROOT_THREADNO 0 /* The deque the search root is queued on */
+#define CACHE_LINE 64
+#define DENTS_BUF_SIZE (64 * 1024) /* Many entries per getdents64 call */
+#define DIR_OPEN_FLAGS (O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)
+#define ARENA_CHUNK_SIZE (256 * 1024)
+#define ARENA_ALIGN _Alignof(struct dnode)
+#define FD_RESERVE 8 /* Descriptors not counted in the default fd budget */
+#define OUT_BUF_SIZE (64 * 1024) /* Matches are written this much at a time */
+#define URING_DEPTH 64   /* Requests a thread has in flight, at most */
+#define URING_PREFETCH 8 /* Directories a thread opens ahead of its scan */
+#define STAT_BUCKETS 32  /* Of the stat latency histogram, by powers of 2 ns */
+#define SAMPLE_NS (10 * 1000 * 1000) /* How often --stats samples the queue */
+#define DEPTH_COLUMNS 32 /* Queue depth samples shown, merged by their max */
+#define AUTO_THREADS_PER_CPU 4 /* Most threads in auto mode, per CPU */
+#define ADAPT_NS (20 * 1000 * 1000) /* How often auto mode adjusts them */
+#define MPMC_SIZE (64 * 1024) /* Directories queued in the ring, at most */
+
+/* The record getdents64 fills its buffer with, see getdents64(2) */
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/*
+ * A directory. Its path is its parent's path, '/' and its name, so children
+ * share the prefix of their parent instead of each holding a copy of it.
+ *
+ * A directory is queued unopened, and opened by the thread that dequeues it,
+ * relative to its parent's fd while the parent still has it open. fd_refs
+ * counts the users of fd: the thread scanning the directory, and descendants
+ * in the middle of an openat. Once it drops to 0 fd is closed for good, and
+ * children left are opened relative to the nearest ancestor still open
+ * instead. When a directory's scan ends with children still unopened, it may
+ * keep its fd open for them (held) if the fd budget allows. Its scanning
+ * thread's reference then stays until the last of them is opened, which
+ * unopened (children left + 1 for the scan) tracks.
+ *
+ * With --index, a directory whose mtime matches the old index is listed from
+ * it and never opened: its fd stays -1, and its children are opened relative
+ * to an ancestor.
+ */
+struct dnode {
+    struct dnode *parent; /* NULL for the search root directory */
+    size_t path_len;      /* Of the path from the search root directory */
+    size_t name_len;
+    int fd; /* -1 until the directory is dequeued */
+    atomic_uint fd_refs;
+    atomic_uint unopened;
+    bool held;
+    uint32_t index_dir; /* Its record in the old index, or INDEX_NO_DIR */
+    int64_t mtime_sec;  /* With --index, when dequeued */
+    uint32_t mtime_nsec;
+    struct listing *listing; /* Its entries, for the new index */
+    TAILQ_ENTRY(dnode)
+    queue_node;
+    char name[]; /* The search root directory's path, for the search root */
+};
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size; /* Of data */
+    _Alignas(ARENA_ALIGN) char data[];
+};
+
+/*
+ * The entries of a scanned directory, for writing the new index. name is in
+ * the arena, or in the old index for a directory listed from it.
+ */
+struct listed_entry {
+    char *name;
+    struct dnode *child; /* For a subdirectory */
+    unsigned char type;
+};
+
+struct listing {
+    size_t n;
+    struct listed_entry entries[];
+};
+
+/*
+ * A per thread bump allocator for the dnodes: only its owner allocates from
+ * it, and nothing is freed until the traversal ends, as a dnode is referenced
+ * by all of its descendants. Dnodes may be stolen by other threads, so the
+ * arenas outlive the threads and are released in bulk by the main thread.
+ */
+struct arena {
+    _Alignas(CACHE_LINE) struct arena_chunk *chunks; /* Newest first */
+    size_t used;                                      /* Of the newest chunk */
+};
 
-#define ARG_NUM 4
-#define INIT_THREADNO 0
-#define INIT_FINISHED_THREADNO 1
+/*
+ * A work-stealing deque. Its owner pushes and pops directories at the tail
+ * (LIFO, so a freshly found subdirectory is scanned while its parent is still
+ * hot in the cache), and idle threads steal the oldest ones from the head.
+ * Aligned so that neighbouring deques do not share a cache line.
+ */
+struct deque {
+    _Alignas(CACHE_LINE) pthread_mutex_t lock;
+    TAILQ_HEAD(deque_head, dnode) head;
+};
+
+/*
+ * Counters a thread updates as it goes, and others only read. All but found
+ * are only kept with --stats, and the times are in ns.
+ */
+struct thread_counters {
+    _Alignas(CACHE_LINE) atomic_ulong found; /* Matches written to stdout */
+    atomic_ulong dirs;    /* Scanned */
+    atomic_ulong entries; /* Of the scanned directories */
+    atomic_ulong asleep;  /* On nonempty_cond */
+    atomic_ulong lock_wait;  /* For the deque locks, when not free at once */
+    atomic_ulong contended;  /* Deque locks not free at once */
+    atomic_ulong stat_latency[STAT_BUCKETS]; /* [i]: under 2^(i+1) ns */
+};
+
+enum engine {
+    ENGINE_SYNC,  /* openat, getdents64 and fstatat, one after another */
+    ENGINE_URING, /* openat and statx through io_uring, many in flight */
+};
 
 static struct global_s {
     unsigned int max_thread_number;
-    unsigned int found_counter;
-    char *sterm;
+    bool auto_threads;   /* Only the first active threads take directories */
+    atomic_uint active;  /* Adjusted by adapt_threads in auto mode */
+    bool pin;            /* Each thread to its CPU of topo */
+    struct topology topo;
+    unsigned int *victims; /* Per thread, the others in the order it steals */
+    enum engine engine;
+    bool stats; /* Report the counters at exit and on SIGUSR1 */
+    atomic_bool uring_failed; /* Some thread fell back to the sync engine */
+    char separator; /* Written after each match */
+    FILE *summary;  /* Where the number of matches is reported */
+    char **patterns; /* The search term, and those from a pattern file */
+    size_t npatterns;
+    int match_flags;
+    struct matcher matcher;
+    struct predicates preds;
+    char *index_path; /* With --index */
+    struct index index; /* The old one, if there is a valid one */
     char *init_dir_name;
-    DIR *init_dir;
-    pthread_mutex_t queue_lock;
+    int init_dir;
+    unsigned int fd_budget; /* Directories open at once, at most */
+    atomic_uint held_fds;   /* Kept open for children, prefetched, or rings */
+    struct dnode *root;
+    struct deque *deques; /* One per thread, indexed by tid */
+    struct arena *arenas; /* One per thread, indexed by tid */
+    struct thread_counters *counters; /* One per thread, indexed by tid */
+    atomic_uint queued;   /* Directories sitting in some deque */
+    atomic_uint pending;  /* Directories queued or being scanned */
+    atomic_uint asleep_counter;
+#ifdef PFIND_QUEUE_MPMC
+    /*
+     * Built with QUEUE=mpmc, directories are queued on a lock-free ring that
+     * all the threads share, and only what overflows it goes to the deques.
+     * Sleeping threads wait on wake_seq as a futex rather than on
+     * nonempty_cond, so that queueing takes no lock at all.
+     */
+    struct mpmc_ring ring;
+    atomic_uint overflowed; /* Directories in the deques */
+    atomic_uint wake_seq;   /* Bumped for every wakeup */
+#endif
+    atomic_bool done;        /* All the threads exited */
+    uint64_t start;          /* When the search started, in ns */
+    unsigned int *depths;    /* queued, sampled every SAMPLE_NS with --stats */
+    size_t ndepths, depths_size;
     pthread_mutex_t nonempty_cond_lock;
-    pthread_mutex_t found_counter_lock;
+    pthread_mutex_t output_lock; /* Held for a whole flush */
     pthread_cond_t nonempty_cond;
-} global = {.found_counter = 0};
+    pthread_cond_t active_cond; /* For threads that auto mode left out */
+} global = {.separator = '\n'};
+
+/*
+ * A request a thread has in flight in its io_uring: the openat of a dequeued
+ * directory, or the statx of an entry of the directory it scans.
+ */
+struct uring_req {
+    struct dnode *node; /* The directory an openat opens, or NULL */
+    struct dnode *base; /* Whose fd the openat is relative to, or NULL */
+    int base_fd;        /* What the openat is relative to */
+    char *name;         /* The entry a statx is for, in the getdents64 buffer */
+    uint64_t start;     /* When the statx was submitted, with --stats */
+    struct statx stx;
+    struct uring_req *next_free;
+};
 
 struct thread_resources { /* Free this if a thread exits */
     unsigned int tid;
-    char *name_to_free;
-    DIR *dir_to_close;
-    struct dnode *node_to_free;
+    char *path;         /* Where paths of matches are built */
+    size_t path_size;   /* Of path */
+    size_t path_prefix; /* Length of curr_node's path already in path, or 0 */
+    bool holds_fd;           /* One of curr_node's fd_refs is ours */
+    struct dnode *curr_node; /* The directory being scanned */
+    char *out;               /* Matches not written to stdout yet */
+    size_t out_len;          /* Of out */
+    unsigned long out_count; /* Matches in out */
+    struct listed_entry *listed; /* curr_node's entries, with --index */
+    size_t nlisted, listed_size;
+    /* The io_uring engine's */
+    struct uring *ring;         /* NULL for the sync engine */
+    struct uring_req *reqs;     /* URING_DEPTH of them */
+    struct uring_req *free_reqs;
+    unsigned int prefetched;    /* Directories dequeued but not scanned yet */
+    unsigned int fd_slots;      /* Of the fd budget, taken for prefetching */
+    unsigned int statx_pending; /* Of entries of curr_node */
+    struct deque_head ready;    /* Prefetched directories already opened */
 };
 
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * Adds n to a counter of the current thread's. Only it writes its counters, so
+ * this needs no atomic read-modify-write.
+ */
+void count(atomic_ulong *counter, unsigned long n) {
+    atomic_store_explicit(
+        counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+        memory_order_relaxed);
+}
+
+void count_stat_latency(uint64_t ns, struct thread_counters *counters) {
+    unsigned int bucket = 63 - (unsigned int)__builtin_clzll(ns | 1);
+    if (bucket >= STAT_BUCKETS) bucket = STAT_BUCKETS - 1;
+    count(&counters->stat_latency[bucket], 1);
+}
+
 struct thread_resources *safe_thread_resources_ctor(unsigned int tid) {
 
     struct thread_resources *t_res = malloc(sizeof(struct thread_resources));
-    if (t_res == NULL) {
+    char *path = malloc(PATH_MAX);
+    char *out = malloc(OUT_BUF_SIZE);
+    if (t_res == NULL || path == NULL || out == NULL) {
         fprintf(stderr, "malloc failed for thread %u: %s\n", tid,
                 strerror(errno));
-        if (tid == INIT_THREADNO) closedir(global.init_dir);
+        free(t_res);
+        free(path);
+        free(out);
         pthread_exit((void *)EXIT_FAILURE);
     }
-    t_res->tid = tid;
+    *t_res = (struct thread_resources){
+        .tid = tid, .path = path, .path_size = PATH_MAX, .out = out};
+    TAILQ_INIT(&t_res->ready);
     return t_res;
 }
 
-void safe_thread_resources_dtor(struct thread_resources *t_res) {
-    /* This condition means: we are not in the init thread or we are in the init
-     * thread but after the init */
-    if (t_res->tid != INIT_THREADNO) free(t_res->name_to_free);
-    free(t_res->node_to_free);
-    if (closedir(t_res->dir_to_close) < 0) {
-        fprintf(stderr, "closedir failed for thread %u: %s\n", t_res->tid,
+/*
+ * Writes all of buf to stdout, which may take several writes to a pipe, so
+ * output_lock keeps other threads' matches from getting in between. Returns
+ * false if it failed.
+ */
+bool write_all(char *buf, size_t len) {
+    ssize_t written = 0;
+    pthread_mutex_lock(&global.output_lock);
+    while (len) {
+        if ((written = write(STDOUT_FILENO, buf, len)) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        buf += written;
+        len -= (size_t)written;
+    }
+    pthread_mutex_unlock(&global.output_lock);
+    return written >= 0;
+}
+
+/*
+ * Writes the matches buffered by the current thread at once, and only then
+ * counts them, so the count never exceeds what was printed. They are dropped
+ * if the write failed.
+ */
+bool flush_output(struct thread_resources *t_res) {
+    bool written = write_all(t_res->out, t_res->out_len);
+    if (written)
+        atomic_fetch_add_explicit(&global.counters[t_res->tid].found,
+                                  t_res->out_count, memory_order_relaxed);
+    else
+        fprintf(stderr, "write failed for thread %u: %s\n", t_res->tid,
                 strerror(errno));
-        free(t_res);
-        pthread_exit((void *)EXIT_FAILURE);
+    t_res->out_len = 0;
+    t_res->out_count = 0;
+    return written;
+}
+
+void dir_done(void);
+void release_held_fd(void);
+
+/*
+ * Runs when a thread exits, however it does: its matches are still printed.
+ * If it failed with directories prefetched by the io_uring engine, these are
+ * given up, as the directory it was scanning is, and so are the fd budget's
+ * slots taken for them.
+ */
+void safe_thread_resources_free(void *arg) {
+    struct thread_resources *t_res = arg;
+    flush_output(t_res);
+    if (t_res->ring != NULL) {
+        for (unsigned int i = 0; i < URING_DEPTH; ++i)
+            if (t_res->reqs[i].node != NULL) dir_done();
+        while (!TAILQ_EMPTY(&t_res->ready)) {
+            TAILQ_REMOVE(&t_res->ready, TAILQ_FIRST(&t_res->ready),
+                         queue_node);
+            dir_done();
+        }
+        for (; t_res->fd_slots; --t_res->fd_slots) release_held_fd();
+        uring_free(t_res->ring);
+        release_held_fd(); /* The ring's */
+        free(t_res->ring);
+        free(t_res->reqs);
     }
+    free(t_res->listed);
+    free(t_res->path);
+    free(t_res->out);
+    free(t_res);
+}
+
+/*
+ * Wakes up a thread sleeping in next_dir, or all of them
+ */
+void wake_sleepers(bool all) {
+#ifdef PFIND_QUEUE_MPMC
+    atomic_fetch_add(&global.wake_seq, 1);
+    syscall(SYS_futex, &global.wake_seq, FUTEX_WAKE_PRIVATE, all ? INT_MAX : 1,
+            NULL, NULL, 0);
+#else
+    pthread_mutex_lock(&global.nonempty_cond_lock);
+    if (all)
+        pthread_cond_broadcast(&global.nonempty_cond);
+    else
+        pthread_cond_signal(&global.nonempty_cond);
+    pthread_mutex_unlock(&global.nonempty_cond_lock);
+#endif
+}
+
+/*
+ * Marks the directory the current thread scanned as done. The thread that
+ * finishes the last pending directory wakes up the sleeping ones so they can
+ * exit: nothing is queued, and no thread is left to queue more.
+ */
+void dir_done(void) {
+    if (atomic_fetch_sub(&global.pending, 1) == 1) {
+        wake_sleepers(true);
+        pthread_mutex_lock(&global.nonempty_cond_lock);
+        pthread_cond_broadcast(&global.active_cond);
+        pthread_mutex_unlock(&global.nonempty_cond_lock);
+    }
+}
+
+void release_dir_fd(struct dnode *node, struct thread_resources *t_res);
+
+/*
+ * Releases what the current thread holds for the directory it scans. The
+ * directory itself stays in the arena.
+ */
+void safe_thread_resources_dtor(struct thread_resources *t_res) {
+    struct dnode *node = t_res->curr_node;
+    bool holds_fd = t_res->holds_fd;
+    t_res->curr_node = NULL;
+    t_res->holds_fd = false;
+    t_res->path_prefix = 0;
+    if (node == NULL) return;
+    dir_done();
+    if (holds_fd) release_dir_fd(node, t_res);
 }
 
 void *safe_malloc(size_t size, struct thread_resources *t_res) {
@@ -70,63 +412,470 @@ void *safe_malloc(size_t size, struct thread_resources *t_res) {
     return ptr;
 }
 
-DIR *safe_opendir(char *name, struct thread_resources *t_res) {
-    DIR *curr_dir = opendir(name);
-    if (curr_dir == NULL) {
-        fprintf(stderr, "opendir failed for thread %u: %s\n", t_res->tid,
+void *safe_realloc(void *ptr, size_t size, struct thread_resources *t_res) {
+    void *new_ptr = realloc(ptr, size);
+    if (new_ptr == NULL) {
+        fprintf(stderr, "realloc failed for thread %u: %s\n", t_res->tid,
+                strerror(errno));
+        safe_thread_resources_dtor(t_res);
+        pthread_exit((void *)EXIT_FAILURE);
+    }
+    return new_ptr;
+}
+
+/*
+ * Bump allocates from the current thread's arena, starting a new chunk when
+ * the newest one is full
+ */
+void *arena_alloc(size_t size, struct thread_resources *t_res) {
+    struct arena *arena = &global.arenas[t_res->tid];
+    struct arena_chunk *chunk = arena->chunks;
+    void *ptr;
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    if (chunk == NULL || chunk->size - arena->used < size) {
+        size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        chunk = safe_malloc(sizeof(struct arena_chunk) + chunk_size, t_res);
+        chunk->next = arena->chunks;
+        chunk->size = chunk_size;
+        arena->chunks = chunk;
+        arena->used = 0;
+    }
+    ptr = chunk->data + arena->used;
+    arena->used += size;
+    return ptr;
+}
+
+/*
+ * Opens the directory name relative to the open directory dir_fd, so the
+ * kernel does not walk the path from the search root again. dir_fd may be
+ * AT_FDCWD, for a path.
+ */
+int safe_openat(int dir_fd, char *name, struct thread_resources *t_res) {
+    int fd = openat(dir_fd, name, DIR_OPEN_FLAGS);
+    if (fd < 0) {
+        fprintf(stderr, "openat failed for thread %u: %s\n", t_res->tid,
                 strerror(errno));
         safe_thread_resources_dtor(t_res);
         pthread_exit((void *)EXIT_FAILURE);
     }
 
-    return curr_dir;
+    return fd;
 }
 
-struct dnode {
-    char *name; /* Path from the search root directory */
-    DIR *dir;
-    SIMPLEQ_ENTRY(dnode)
-    queue_node;
-};
+/*
+ * Takes a reference to the fd of node, unless it was closed for good
+ */
+bool acquire_dir_fd(struct dnode *node) {
+    unsigned int refs = atomic_load(&node->fd_refs);
+    while (refs)
+        if (atomic_compare_exchange_weak(&node->fd_refs, &refs, refs + 1))
+            return true;
+    return false;
+}
+
+void release_dir_fd(struct dnode *node, struct thread_resources *t_res) {
+    if (atomic_fetch_sub(&node->fd_refs, 1) != 1) return;
+    if (node->held) release_held_fd();
+    if (close(node->fd) < 0) {
+        fprintf(stderr, "close failed for thread %u: %s\n", t_res->tid,
+                strerror(errno));
+        safe_thread_resources_dtor(t_res);
+        pthread_exit((void *)EXIT_FAILURE);
+    }
+}
+
+/*
+ * Takes one of the fd budget's slots for keeping a scanned directory open. A
+ * slot is left in the budget for each thread's scanned directory.
+ */
+bool acquire_held_fd(void) {
+    unsigned int held = atomic_load(&global.held_fds);
+    while (held + global.max_thread_number < global.fd_budget)
+        if (atomic_compare_exchange_weak(&global.held_fds, &held, held + 1))
+            return true;
+    return false;
+}
+
+void release_held_fd(void) { atomic_fetch_sub(&global.held_fds, 1); }
+
+/*
+ * Reads as many entries of the open directory fd as fit in buf. Returns the
+ * number of bytes read, 0 at the end of the directory.
+ */
+size_t safe_getdents(int fd, char *buf, struct thread_resources *t_res) {
+    long nread = syscall(SYS_getdents64, fd, buf, DENTS_BUF_SIZE);
+    if (nread < 0) {
+        fprintf(stderr, "getdents64 failed for thread %u: %s\n", t_res->tid,
+                strerror(errno));
+        safe_thread_resources_dtor(t_res);
+        pthread_exit((void *)EXIT_FAILURE);
+    }
+
+    return (size_t)nread;
+}
+
+/*
+ * Makes room for a path of len characters in the current thread's path buffer
+ */
+void reserve_path(size_t len, struct thread_resources *t_res) {
+    if (len >= t_res->path_size) {
+        t_res->path_size = 2 * len;
+        t_res->path = safe_realloc(t_res->path, t_res->path_size, t_res);
+    }
+}
+
+/*
+ * Builds the path of node relative to its ancestor from in buf, or its whole
+ * path if from is NULL, by following the parent links. buf must fit it.
+ */
+void node_path(struct dnode *node, struct dnode *from, char *buf) {
+    size_t skip = from != NULL ? from->path_len + 1 : 0, pos;
+    buf[node->path_len - skip] = '\0';
+    for (; node != from; node = node->parent) {
+        pos = node->path_len - node->name_len - skip;
+        memcpy(buf + pos, node->name, node->name_len);
+        if (pos) buf[pos - 1] = '/';
+    }
+}
+
+/*
+ * Returns the path of the directory being scanned. It is built in the current
+ * thread's path buffer, once per directory.
+ */
+char *build_dir_path(struct thread_resources *t_res) {
+    if (!t_res->path_prefix) {
+        reserve_path(t_res->curr_node->path_len, t_res);
+        node_path(t_res->curr_node, NULL, t_res->path);
+        t_res->path_prefix = t_res->curr_node->path_len;
+    }
+    t_res->path[t_res->path_prefix] = '\0';
+    return t_res->path;
+}
 
 /*
- * Returns name_prefix + '\0' + '/' + rel_name
+ * Returns the path of the file name in the directory being scanned, built
+ * after the directory's path in the current thread's path buffer
  */
-char *concat_path_file(char *name_prefix, char *rel_name,
-                       struct thread_resources *t_res) {
-    size_t prev_name_len = strlen(name_prefix);
-    char *name = safe_malloc(
-        (prev_name_len + strlen(rel_name) + 2) * sizeof(char), t_res);
-    strcpy(name, name_prefix);
-    name[prev_name_len] = '/';
-    name[prev_name_len + 1] = '\0';
-    strcat(name, rel_name);
-    return name;
+char *build_path(char *name, struct thread_resources *t_res) {
+    size_t name_len = strlen(name);
+    build_dir_path(t_res);
+    reserve_path(t_res->path_prefix + 1 + name_len, t_res);
+    t_res->path[t_res->path_prefix] = '/';
+    memcpy(t_res->path + t_res->path_prefix + 1, name, name_len + 1);
+    return t_res->path;
+}
+
+/*
+ * Buffers path as a match of the current thread, and flushes the buffer once
+ * it is full. A path longer than the whole buffer is written on its own.
+ */
+void output_match(char *path, struct thread_resources *t_res) {
+    size_t len = strlen(path) + 1;
+    if (len > OUT_BUF_SIZE - t_res->out_len && !flush_output(t_res)) {
+        safe_thread_resources_dtor(t_res);
+        pthread_exit((void *)EXIT_FAILURE);
+    }
+    if (len > OUT_BUF_SIZE) {
+        path[len - 1] = global.separator;
+        if (!write_all(path, len)) {
+            fprintf(stderr, "write failed for thread %u: %s\n", t_res->tid,
+                    strerror(errno));
+            safe_thread_resources_dtor(t_res);
+            pthread_exit((void *)EXIT_FAILURE);
+        }
+        atomic_fetch_add_explicit(&global.counters[t_res->tid].found, 1,
+                                  memory_order_relaxed);
+        return;
+    }
+    memcpy(t_res->out + t_res->out_len, path, len - 1);
+    t_res->out[t_res->out_len + len - 1] = global.separator;
+    t_res->out_len += len;
+    ++t_res->out_count;
+}
+
+/*
+ * Releases what open_dir_base returned once the open is done: the reference
+ * to the fd of the ancestor base, or, if base is NULL, the descriptor opened
+ * just for it
+ */
+void release_dir_base(struct dnode *base, int base_fd,
+                      struct thread_resources *t_res) {
+    if (base != NULL) {
+        release_dir_fd(base, t_res);
+    } else if (base_fd != AT_FDCWD && close(base_fd) < 0) {
+        fprintf(stderr, "close failed for thread %u: %s\n", t_res->tid,
+                strerror(errno));
+        safe_thread_resources_dtor(t_res);
+        pthread_exit((void *)EXIT_FAILURE);
+    }
+}
+
+/*
+ * Returns what to open the dequeued directory node relative to, and *name is
+ * node's path from there. That is the fd of the nearest ancestor that still
+ * has it open, its parent's mostly, with a reference taken in *base. Only an
+ * ancestor whose path to node fits in PATH_MAX will do, so if none of those
+ * is open, the farthest of them is opened again the same way, just for this,
+ * and *base is NULL. Its path from the search root's is only used when all of
+ * it fits, with AT_FDCWD. A path other than node's name stays in the arena
+ * for as long as the open may need it.
+ */
+int open_dir_base(struct dnode *node, char **name, struct dnode **base,
+                  struct thread_resources *t_res) {
+    struct dnode *from = node->parent, *far = NULL, *far_base;
+    char *far_name;
+    int fd = AT_FDCWD, far_fd;
+    *base = NULL;
+    for (; from != NULL && node->path_len - from->path_len <= PATH_MAX;
+         from = from->parent) {
+        if (acquire_dir_fd(from)) {
+            *base = from;
+            fd = from->fd;
+            break;
+        }
+        far = from;
+    }
+    if (*base == NULL && (from != NULL || node->path_len >= PATH_MAX)) {
+        far_fd = open_dir_base(far, &far_name, &far_base, t_res);
+        fd = safe_openat(far_fd, far_name, t_res);
+        release_dir_base(far_base, far_fd, t_res);
+        from = far;
+    }
+    if (from == node->parent) {
+        *name = node->name;
+    } else {
+        *name = arena_alloc(
+            node->path_len - (from != NULL ? from->path_len + 1 : 0) + 1,
+            t_res);
+        node_path(node, from, *name);
+    }
+    return fd;
+}
+
+/*
+ * Records that node no longer needs its parent's fd, as it was opened, or
+ * found unchanged by --index, relative to base_fd, which is released along
+ * with base
+ */
+void dir_left_parent(struct dnode *node, struct dnode *base, int base_fd,
+                     struct thread_resources *t_res) {
+    struct dnode *parent = node->parent;
+    if (parent == NULL) return;
+    release_dir_base(base, base_fd, t_res);
+    if (atomic_fetch_sub(&parent->unopened, 1) == 1)
+        release_dir_fd(parent, t_res); /* Was held for its last child */
+}
+
+void dir_opened(struct dnode *node, struct dnode *base, int base_fd, int fd,
+                struct thread_resources *t_res) {
+    node->fd = fd;
+    atomic_store(&node->fd_refs, 1);
+    dir_left_parent(node, base, base_fd, t_res);
 }
 
-struct dnode *node_ctor(char *name, DIR *curr_dir,
+/*
+ * With --index, stats the dequeued directory node for its mtime, which goes
+ * into the new index. name is relative to base_fd, which open_dir_base
+ * returned along with base. Returns whether the mtime is the one in the old
+ * index, so that the directory can be listed from it instead of read. Never
+ * when the predicates need to stat its entries.
+ */
+bool dir_unchanged(struct dnode *node, struct dnode *base, int base_fd,
+                   char *name, struct thread_resources *t_res) {
+    struct statx stx;
+    const struct index_dir *old;
+    if (statx(base_fd, name, AT_SYMLINK_NOFOLLOW | (*name ? 0 : AT_EMPTY_PATH),
+              STATX_MTIME, &stx) < 0) {
+        fprintf(stderr, "statx failed for thread %u: %s\n", t_res->tid,
+                strerror(errno));
+        if (node->parent != NULL) release_dir_base(base, base_fd, t_res);
+        safe_thread_resources_dtor(t_res);
+        pthread_exit((void *)EXIT_FAILURE);
+    }
+    node->mtime_sec = stx.stx_mtime.tv_sec;
+    node->mtime_nsec = stx.stx_mtime.tv_nsec;
+    if (node->index_dir == INDEX_NO_DIR || global.preds.stat_mask)
+        return false;
+    old = &global.index.dirs[node->index_dir];
+    return old->mtime_sec == node->mtime_sec &&
+           old->mtime_nsec == node->mtime_nsec;
+}
+
+/*
+ * Opens the directory the current thread dequeued: relative to its parent if
+ * the parent's fd is still open, or else to another ancestor. Returns false,
+ * leaving it unopened, if --index found it unchanged.
+ */
+bool open_dir(struct thread_resources *t_res) {
+    struct dnode *node = t_res->curr_node, *base;
+    char *name;
+    int base_fd;
+    if (node->parent == NULL) {
+        if (global.index_path &&
+            dir_unchanged(node, NULL, global.init_dir, "", t_res))
+            return false;
+        dir_opened(node, NULL, AT_FDCWD, global.init_dir, t_res);
+    } else {
+        base_fd = open_dir_base(node, &name, &base, t_res);
+        if (global.index_path &&
+            dir_unchanged(node, base, base_fd, name, t_res)) {
+            dir_left_parent(node, base, base_fd, t_res);
+            return false;
+        }
+        dir_opened(node, base, base_fd, safe_openat(base_fd, name, t_res),
+                   t_res);
+    }
+    t_res->holds_fd = true;
+    return true;
+}
+
+/*
+ * Called when the current thread finished scanning its directory. If some of
+ * its children are still unopened, keeps its fd open for them, budget
+ * permitting.
+ */
+void finish_dir(struct thread_resources *t_res) {
+    struct dnode *node = t_res->curr_node;
+    if (global.stats) count(&global.counters[t_res->tid].dirs, 1);
+    if (!t_res->holds_fd || atomic_load(&node->unopened) == 1 ||
+        !acquire_held_fd())
+        return;
+    node->held = true;
+    t_res->holds_fd = false; /* The reference is the children's now */
+    if (atomic_fetch_sub(&node->unopened, 1) == 1)
+        release_dir_fd(node, t_res); /* They were all opened meanwhile */
+}
+
+struct dnode *node_ctor(struct dnode *parent, char *name,
                         struct thread_resources *t_res) {
-    struct dnode *node = safe_malloc(sizeof(struct dnode), t_res);
-    node->name = name;
-    node->dir = curr_dir;
+    size_t name_len = strlen(name);
+    struct dnode *node =
+        arena_alloc(sizeof(struct dnode) + name_len + 1, t_res);
+    node->parent = parent;
+    node->path_len = parent->path_len + 1 + name_len;
+    node->name_len = name_len;
+    node->fd = -1;
+    atomic_init(&node->fd_refs, 0);
+    atomic_init(&node->unopened, 1);
+    node->held = false;
+    node->index_dir = INDEX_NO_DIR;
+    node->listing = NULL;
+    memcpy(node->name, name, name_len + 1);
     return node;
 }
 
+void deque_push(struct dnode *node, struct thread_resources *t_res);
+
+/*
+ * With --index, records an entry of the directory being scanned for the new
+ * index. Names are copied out of the getdents64 buffer, but not out of the
+ * old index, which stays mapped until the new one is written.
+ */
+void list_entry(char *name, unsigned char type, struct dnode *child,
+                struct thread_resources *t_res) {
+    size_t len;
+    if (t_res->nlisted == t_res->listed_size) {
+        t_res->listed_size = t_res->listed_size ? t_res->listed_size * 2 : 64;
+        t_res->listed = safe_realloc(
+            t_res->listed, t_res->listed_size * sizeof(struct listed_entry),
+            t_res);
+    }
+    if (child != NULL) {
+        name = child->name;
+    } else if (t_res->curr_node->fd >= 0) {
+        len = strlen(name) + 1;
+        name = memcpy(arena_alloc(len, t_res), name, len);
+    }
+    t_res->listed[t_res->nlisted++] =
+        (struct listed_entry){.name = name, .child = child, .type = type};
+}
+
+/*
+ * With --index, keeps the entries recorded for the directory being scanned
+ * once it is done
+ */
+void list_dir(struct thread_resources *t_res) {
+    size_t size = t_res->nlisted * sizeof(struct listed_entry);
+    struct listing *listing =
+        arena_alloc(sizeof(struct listing) + size, t_res);
+    listing->n = t_res->nlisted;
+    memcpy(listing->entries, t_res->listed, size);
+    t_res->curr_node->listing = listing;
+    t_res->nlisted = 0;
+}
+
+/*
+ * Returns whether an entry of the directory being scanned has to be stat'ed
+ * before handle_entry: when getdents64 did not report its type, or when it
+ * is to be printed but for the predicates on its metadata. So no stat is
+ * issued for an entry that its name or type already rule out.
+ */
+bool entry_needs_stat(char *name, unsigned char type) {
+    return type == DT_UNKNOWN ||
+           (global.preds.stat_mask && pred_type(&global.preds, type) &&
+            matcher_match(&global.matcher, name));
+}
+
+/*
+ * Queues an entry of the directory being scanned if it is a directory, and
+ * prints it if its type, name and metadata match. stx is its statx, if
+ * entry_needs_stat asked for it, or else NULL. The path is only built for
+ * what we print.
+ */
+void handle_entry(char *name, unsigned char type, struct statx *stx,
+                  struct thread_resources *t_res) {
+    struct dnode *curr_node = t_res->curr_node, *child = NULL;
+    if (global.stats) count(&global.counters[t_res->tid].entries, 1);
+    if (type == DT_DIR) {
+        child = node_ctor(curr_node, name, t_res);
+        child->index_dir =
+            index_find(&global.index, curr_node->index_dir, name);
+        atomic_fetch_add(&curr_node->unopened, 1);
+    }
+    if (global.index_path) list_entry(name, type, child, t_res);
+    if (child != NULL) deque_push(child, t_res);
+    if (!pred_type(&global.preds, type)) return;
+    /* Not stat'ed while there are metadata predicates: already ruled out */
+    if (stx != NULL ? !pred_match(&global.preds, stx) : global.preds.stat_mask)
+        return;
+    if (matcher_match(&global.matcher, name))
+        output_match(build_path(name, t_res), t_res);
+}
+
+/*
+ * Lists the directory being scanned from the old index, which --index found
+ * it unchanged since
+ */
+void replay_dir(struct thread_resources *t_res) {
+    const struct index_dir *dir =
+        &global.index.dirs[t_res->curr_node->index_dir];
+    const struct index_entry *entries =
+        &global.index.entries[dir->first_entry];
+    for (uint32_t i = 0; i < dir->nentries; ++i)
+        handle_entry((char *)global.index.names + entries[i].name,
+                     entries[i].type, NULL, t_res);
+}
+
 bool is_regular_directory(char *name) {
     return (bool)(strcmp(name, ".") && strcmp(name, ".."));
 }
 
-bool safe_isdir(char *path, struct thread_resources *t_res) {
-    struct stat buf;
-    if (lstat(path, &buf) < 0) {
-        fprintf(stderr, "lstat failed for thread %u: %s\n", t_res->tid,
+/*
+ * Stats name relative to the open directory dir_fd, for its type and what the
+ * predicates need only
+ */
+void safe_statxat(int dir_fd, char *name, struct statx *stx,
+                  struct thread_resources *t_res) {
+    uint64_t start = global.stats ? now_ns() : 0;
+    if (statx(dir_fd, name, AT_SYMLINK_NOFOLLOW,
+              STATX_TYPE | global.preds.stat_mask, stx) < 0) {
+        fprintf(stderr, "statx failed for thread %u: %s\n", t_res->tid,
                 strerror(errno));
         safe_thread_resources_dtor(t_res);
-
         pthread_exit((void *)EXIT_FAILURE);
     }
-
-    return S_ISDIR(buf.st_mode);
+    if (global.stats)
+        count_stat_latency(now_ns() - start, &global.counters[t_res->tid]);
 }
 
 void safe_pthread_mutex_lock(pthread_mutex_t *mutex,
@@ -150,102 +899,758 @@ void safe_pthread_mutex_unlock(pthread_mutex_t *mutex,
 }
 
 /*
- * This is one computation of a thread: popping a directory from the queue,
- * searching for the term in the file names for that directory, and inserting
- * directories in that directory to the queue. dir, dir_name are: the initial
- * root directory to begin with, and its name. sterm is the search term.
+ * Locks a deque. With --stats, the wait is timed when the lock is not free at
+ * once, so an uncontended lock costs no clock reads.
  */
-bool scan_dir(void *tid_arg) {
-    static bool all_threads_asleep = false;
-    static unsigned int asleep_counter = 0;
-    static SIMPLEQ_HEAD(head_s, dnode) head;
-    unsigned int tid = (unsigned int)(intptr_t)(tid_arg);
-    char *new_name, *dir_name, *temp;
-    struct dnode *curr_node, *new_node;
-    struct dirent *dir_ent;
-    DIR *new_dir;
-    struct thread_resources *t_res = safe_thread_resources_ctor(tid);
+void deque_lock(struct deque *deque, struct thread_resources *t_res) {
+    struct thread_counters *counters = &global.counters[t_res->tid];
+    uint64_t start;
+    if (!global.stats) {
+        safe_pthread_mutex_lock(&deque->lock, t_res);
+        return;
+    }
+    if (!pthread_mutex_trylock(&deque->lock)) return;
+    start = now_ns();
+    safe_pthread_mutex_lock(&deque->lock, t_res);
+    count(&counters->lock_wait, now_ns() - start);
+    count(&counters->contended, 1);
+}
+
+/*
+ * Pushes a directory to the tail of the current thread's deque, or to the
+ * ring if built with it, and wakes up a sleeping thread if there is one.
+ * pending and queued are raised before the directory becomes visible, so
+ * pending can never drop to 0 while the directory is queued, and a thread
+ * taking the directory at once cannot bring queued below 0.
+ */
+void deque_push(struct dnode *node, struct thread_resources *t_res) {
+    struct deque *deque = &global.deques[t_res->tid];
+    atomic_fetch_add(&global.pending, 1);
+    /* Pairs with next_dir: either we see the sleeper, or it sees queued > 0 */
+    atomic_fetch_add(&global.queued, 1);
+#ifdef PFIND_QUEUE_MPMC
+    if (!mpmc_push(&global.ring, node)) {
+        atomic_fetch_add(&global.overflowed, 1); /* Before it is visible */
+#endif
+        deque_lock(deque, t_res);
+        TAILQ_INSERT_TAIL(&deque->head, node, queue_node);
+        safe_pthread_mutex_unlock(&deque->lock, t_res);
+#ifdef PFIND_QUEUE_MPMC
+    }
+#endif
+    if (atomic_load(&global.asleep_counter)) wake_sleepers(false);
+}
+
+/*
+ * Pops the newest directory of a deque, or its oldest one if we steal it from
+ * another thread. Returns NULL if the deque is empty.
+ */
+struct dnode *deque_pop(struct deque *deque, bool steal,
+                        struct thread_resources *t_res) {
+    struct dnode *node;
+    deque_lock(deque, t_res);
+    node = steal ? TAILQ_FIRST(&deque->head)
+                 : TAILQ_LAST(&deque->head, deque_head);
+    if (node != NULL) {
+        TAILQ_REMOVE(&deque->head, node, queue_node);
+        atomic_fetch_sub(&global.queued, 1);
+#ifdef PFIND_QUEUE_MPMC
+        atomic_fetch_sub(&global.overflowed, 1);
+#endif
+    }
+    safe_pthread_mutex_unlock(&deque->lock, t_res);
+    return node;
+}
+
+/*
+ * Returns the current thread's own newest directory, or else one stolen from
+ * the other threads, those on its NUMA node first, or NULL if nothing is
+ * queued. Built with the ring, the oldest directory in the ring comes first,
+ * and the deques are only looked at when something overflowed to them.
+ */
+struct dnode *take_dir(struct thread_resources *t_res) {
+    struct dnode *node;
+    unsigned int *victims =
+        &global.victims[t_res->tid * (global.max_thread_number - 1)];
+#ifdef PFIND_QUEUE_MPMC
+    if ((node = mpmc_pop(&global.ring))) {
+        atomic_fetch_sub(&global.queued, 1);
+        return node;
+    }
+    if (!atomic_load(&global.overflowed)) return NULL;
+#endif
+    if ((node = deque_pop(&global.deques[t_res->tid], false, t_res)))
+        return node;
+    for (unsigned int i = 0;
+         i < global.max_thread_number - 1 && atomic_load(&global.queued); ++i)
+        if ((node = deque_pop(&global.deques[victims[i]], true, t_res)))
+            return node;
+    return NULL;
+}
+
+bool is_active(struct thread_resources *t_res) {
+    return t_res->tid < atomic_load(&global.active);
+}
+
+/*
+ * Parks the current thread while auto mode leaves it out, until the search is
+ * done. It takes no directory meanwhile, but its deque may be stolen from.
+ */
+void park(struct thread_resources *t_res) {
+    if (is_active(t_res)) return;
+    safe_pthread_mutex_lock(&global.nonempty_cond_lock, t_res);
+    /* We may have been woken up for a directory: pass it on */
+    if (atomic_load(&global.queued)) {
+#ifdef PFIND_QUEUE_MPMC
+        wake_sleepers(false);
+#else
+        pthread_cond_signal(&global.nonempty_cond); /* We hold its lock */
+#endif
+    }
+    while (!is_active(t_res) && atomic_load(&global.pending))
+        pthread_cond_wait(&global.active_cond, &global.nonempty_cond_lock);
+    safe_pthread_mutex_unlock(&global.nonempty_cond_lock, t_res);
+}
+
+/*
+ * Returns the next directory for the current thread to scan. Sleeps while
+ * nothing is queued but some thread is still scanning, as it may queue more.
+ * Returns NULL once nothing is queued or being scanned.
+ */
+struct dnode *next_dir(struct thread_resources *t_res) {
+    struct dnode *node;
+    uint64_t start;
+    bool done;
+#ifdef PFIND_QUEUE_MPMC
+    unsigned int seq;
+#endif
     while (true) {
-        *t_res = (struct thread_resources){t_res->tid};
-        if (tid == INIT_THREADNO) { /* Initialize the currently empty queue */
-            safe_pthread_mutex_lock(&global.queue_lock, t_res);
-            SIMPLEQ_INIT(&head);
-            safe_pthread_mutex_unlock(&global.queue_lock, t_res);
-            curr_node = node_ctor(global.init_dir_name, global.init_dir, t_res);
-            t_res->node_to_free = curr_node;
-        } else { /* Dequeue a dir for the current thread */
-            safe_pthread_mutex_lock(&global.nonempty_cond_lock, t_res);
-            ++asleep_counter;
-            while (SIMPLEQ_EMPTY(&head)) {
-                /* The next if reduces unnecessary broadcasts compared to */
-                if (all_threads_asleep) { /* the next if */
-                    safe_pthread_mutex_unlock(&global.nonempty_cond_lock,
-                                              t_res);
-                    pthread_exit((void *)EXIT_SUCCESS);
-                }
-                if (asleep_counter == global.max_thread_number) {
-                    all_threads_asleep = true;
-                    pthread_cond_broadcast(&global.nonempty_cond);
-                    safe_pthread_mutex_unlock(&global.nonempty_cond_lock,
-                                              t_res);
-                    pthread_exit((void *)EXIT_SUCCESS);
+        park(t_res);
+        if ((node = take_dir(t_res))) return node;
+        start = global.stats ? now_ns() : 0;
+#ifdef PFIND_QUEUE_MPMC
+        /* A wakeup after we read seq makes the futex wait return at once */
+        seq = atomic_load(&global.wake_seq);
+        atomic_fetch_add(&global.asleep_counter, 1);
+        if (!atomic_load(&global.queued) && atomic_load(&global.pending))
+            syscall(SYS_futex, &global.wake_seq, FUTEX_WAIT_PRIVATE, seq,
+                    NULL, NULL, 0);
+        atomic_fetch_sub(&global.asleep_counter, 1);
+        done = !atomic_load(&global.pending);
+#else
+        safe_pthread_mutex_lock(&global.nonempty_cond_lock, t_res);
+        atomic_fetch_add(&global.asleep_counter, 1);
+        while (!atomic_load(&global.queued) && atomic_load(&global.pending))
+            pthread_cond_wait(&global.nonempty_cond,
+                              &global.nonempty_cond_lock);
+        atomic_fetch_sub(&global.asleep_counter, 1);
+        done = !atomic_load(&global.pending);
+        safe_pthread_mutex_unlock(&global.nonempty_cond_lock, t_res);
+#endif
+        if (global.stats)
+            count(&global.counters[t_res->tid].asleep, now_ns() - start);
+        if (done) return NULL;
+    }
+}
+
+/*
+ * The sync engine: dequeues, opens and scans one directory at a time, and
+ * stats the entries of unknown type one after another
+ */
+void sync_scan_dirs(char *dents, struct thread_resources *t_res) {
+    size_t nread, pos;
+    char *dir_name;
+    struct dnode *curr_node;
+    struct linux_dirent64 *dir_ent;
+    struct statx stx;
+    while ((curr_node = next_dir(t_res))) {
+        t_res->curr_node = curr_node;
+        if (!open_dir(t_res)) replay_dir(t_res);
+        while (t_res->holds_fd &&
+               (nread = safe_getdents(curr_node->fd, dents, t_res))) {
+            for (pos = 0; pos < nread; pos += dir_ent->d_reclen) {
+                dir_ent = (struct linux_dirent64 *)(dents + pos);
+                dir_name = dir_ent->d_name;
+                if (!is_regular_directory(dir_name)) continue;
+                if (entry_needs_stat(dir_name, dir_ent->d_type)) {
+                    safe_statxat(curr_node->fd, dir_name, &stx, t_res);
+                    handle_entry(dir_name, IFTODT(stx.stx_mode), &stx, t_res);
+                } else {
+                    handle_entry(dir_name, dir_ent->d_type, NULL, t_res);
                 }
-                pthread_cond_wait(&global.nonempty_cond,
-                                  &global.nonempty_cond_lock);
             }
-            --asleep_counter;
-            safe_pthread_mutex_lock(&global.queue_lock, t_res);
-            curr_node = SIMPLEQ_FIRST(&head);
-            t_res->node_to_free = curr_node;
-            SIMPLEQ_REMOVE_HEAD(&head, queue_node);
-            safe_pthread_mutex_unlock(&global.queue_lock, t_res);
-            safe_pthread_mutex_unlock(&global.nonempty_cond_lock, t_res);
-            t_res->name_to_free = curr_node->name;
         }
-        t_res->dir_to_close = curr_node->dir;
-        while ((dir_ent = readdir(curr_node->dir))) {
-            dir_name = dir_ent->d_name;
-            new_name = concat_path_file(curr_node->name, dir_name, t_res);
-            if (safe_isdir(new_name, t_res)) {
-                if (is_regular_directory(dir_name)) {
-                    new_dir = safe_opendir(new_name, t_res);
-                    new_node = node_ctor(new_name, new_dir, t_res);
-                    safe_pthread_mutex_lock(&global.nonempty_cond_lock, t_res);
-                    safe_pthread_mutex_lock(&global.queue_lock, t_res);
-                    SIMPLEQ_INSERT_TAIL(&head, new_node, queue_node);
-                    pthread_cond_signal(&global.nonempty_cond);
-                    safe_pthread_mutex_unlock(&global.queue_lock, t_res);
-                    safe_pthread_mutex_unlock(&global.nonempty_cond_lock,
-                                              t_res);
-                }
-            } else if (strstr(dir_name, global.sterm) != NULL) {
-                temp = concat_path_file(curr_node->name, dir_name, t_res);
-                printf("%s\n", temp);
-                free(temp);
-                safe_pthread_mutex_lock(&global.found_counter_lock, t_res);
-                ++global.found_counter;
-                safe_pthread_mutex_unlock(&global.found_counter_lock, t_res);
+        if (global.index_path) list_dir(t_res);
+        finish_dir(t_res);
+        safe_thread_resources_dtor(t_res);
+    }
+}
+
+/*
+ * Sets up the current thread's io_uring, whose fd takes a slot of the fd
+ * budget. Returns false if io_uring is not available, or the budget has no
+ * slot left for it, after warning about it once.
+ */
+bool uring_setup(struct thread_resources *t_res) {
+    bool has_slot = acquire_held_fd();
+    t_res->ring = has_slot ? malloc(sizeof(struct uring)) : NULL;
+    t_res->reqs = has_slot ? calloc(URING_DEPTH, sizeof(struct uring_req))
+                           : NULL;
+    if (!has_slot) errno = EMFILE;
+    if (t_res->ring == NULL || t_res->reqs == NULL ||
+        uring_init(t_res->ring, URING_DEPTH) < 0) {
+        if (!atomic_exchange(&global.uring_failed, true))
+            fprintf(stderr, "io_uring unavailable, using the sync engine: %s\n",
+                    strerror(errno));
+        if (has_slot) release_held_fd();
+        free(t_res->ring);
+        free(t_res->reqs);
+        t_res->ring = NULL;
+        return false;
+    }
+    for (unsigned int i = 0; i < URING_DEPTH; ++i)
+        t_res->reqs[i].next_free = i + 1 < URING_DEPTH ? &t_res->reqs[i + 1]
+                                                       : NULL;
+    t_res->free_reqs = t_res->reqs;
+    return true;
+}
+
+/*
+ * Returns an SQE and a request for it, submitting what was filled so far and
+ * waiting for completions if either runs out
+ */
+void uring_reap(unsigned int wait_nr, struct thread_resources *t_res);
+
+struct io_uring_sqe *uring_get(struct uring_req **req,
+                               struct thread_resources *t_res) {
+    struct io_uring_sqe *sqe;
+    while (t_res->free_reqs == NULL) uring_reap(1, t_res);
+    while ((sqe = uring_get_sqe(t_res->ring)) == NULL) uring_reap(0, t_res);
+    *req = t_res->free_reqs;
+    t_res->free_reqs = (*req)->next_free;
+    return sqe;
+}
+
+/*
+ * Submits the openat of a dequeued directory. The search root is already open.
+ */
+void uring_open(struct dnode *node, struct thread_resources *t_res) {
+    struct io_uring_sqe *sqe;
+    struct uring_req *req;
+    struct dnode *base;
+    char *name;
+    int base_fd;
+    if (node->parent == NULL) {
+        if (!global.index_path ||
+            !dir_unchanged(node, NULL, global.init_dir, "", t_res))
+            dir_opened(node, NULL, AT_FDCWD, global.init_dir, t_res);
+        TAILQ_INSERT_TAIL(&t_res->ready, node, queue_node);
+        return;
+    }
+    base_fd = open_dir_base(node, &name, &base, t_res);
+    if (global.index_path && dir_unchanged(node, base, base_fd, name, t_res)) {
+        /* Left unopened, fd is -1 */
+        dir_left_parent(node, base, base_fd, t_res);
+        TAILQ_INSERT_TAIL(&t_res->ready, node, queue_node);
+        return;
+    }
+    sqe = uring_get(&req, t_res);
+    req->node = node;
+    req->base = base;
+    req->base_fd = base_fd;
+    uring_prep_openat(sqe, base_fd, name, DIR_OPEN_FLAGS, req);
+}
+
+/*
+ * Submits the statx of an entry of the directory being scanned, for its type
+ * and what the predicates need
+ */
+void uring_stat(char *name, struct thread_resources *t_res) {
+    struct uring_req *req;
+    struct io_uring_sqe *sqe = uring_get(&req, t_res);
+    req->node = NULL;
+    req->name = name;
+    req->start = global.stats ? now_ns() : 0;
+    uring_prep_statx(sqe, t_res->curr_node->fd, name, AT_SYMLINK_NOFOLLOW,
+                     STATX_TYPE | global.preds.stat_mask, &req->stx, req);
+    ++t_res->statx_pending;
+}
+
+/*
+ * Handles a completed request. A failed one fails the thread, as it would in
+ * the sync engine.
+ */
+void uring_complete(struct uring_req *req, int res,
+                    struct thread_resources *t_res) {
+    if (res < 0) {
+        fprintf(stderr, "%s failed for thread %u: %s\n",
+                req->node != NULL ? "openat" : "statx", t_res->tid,
+                strerror(-res));
+        safe_thread_resources_dtor(t_res);
+        pthread_exit((void *)EXIT_FAILURE);
+    }
+    if (req->node != NULL) {
+        dir_opened(req->node, req->base, req->base_fd, res, t_res);
+        TAILQ_INSERT_TAIL(&t_res->ready, req->node, queue_node);
+        req->node = NULL;
+    } else {
+        --t_res->statx_pending;
+        if (global.stats) /* Includes the time queued in the ring */
+            count_stat_latency(now_ns() - req->start,
+                               &global.counters[t_res->tid]);
+        handle_entry(req->name, IFTODT(req->stx.stx_mode), &req->stx, t_res);
+    }
+    req->next_free = t_res->free_reqs;
+    t_res->free_reqs = req;
+}
+
+/*
+ * Submits what was filled so far, waits for wait_nr completions, and handles
+ * all the completions there are
+ */
+void uring_reap(unsigned int wait_nr, struct thread_resources *t_res) {
+    struct io_uring_cqe *cqe;
+    struct uring_req *req;
+    int res;
+    if (uring_submit(t_res->ring, wait_nr) < 0) {
+        fprintf(stderr, "io_uring_enter failed for thread %u: %s\n",
+                t_res->tid, strerror(errno));
+        safe_thread_resources_dtor(t_res);
+        pthread_exit((void *)EXIT_FAILURE);
+    }
+    while ((cqe = uring_peek_cqe(t_res->ring)) != NULL) {
+        req = (struct uring_req *)(uintptr_t)cqe->user_data;
+        res = cqe->res;
+        uring_cqe_seen(t_res->ring);
+        uring_complete(req, res, t_res);
+    }
+}
+
+/*
+ * Gives back the fd budget's slots the io_uring engine no longer needs for
+ * its prefetched directories: all but one of these take one, as the thread's
+ * own slot goes to the next it scans
+ */
+void release_fd_slots(struct thread_resources *t_res) {
+    for (; t_res->fd_slots && t_res->fd_slots >= t_res->prefetched;
+         --t_res->fd_slots)
+        release_held_fd();
+}
+
+/*
+ * Returns the next directory for the io_uring engine to open ahead of its
+ * scan, or NULL to scan those it has first. Past the first, each takes a slot
+ * of the fd budget, so none is taken once the budget is used up.
+ */
+struct dnode *prefetch_dir(struct thread_resources *t_res) {
+    struct dnode *node;
+    if (!t_res->prefetched) return next_dir(t_res);
+    if (!is_active(t_res)) return NULL;
+    if (t_res->fd_slots < t_res->prefetched) {
+        if (!acquire_held_fd()) return NULL;
+        ++t_res->fd_slots;
+    }
+    if ((node = take_dir(t_res)) == NULL) release_fd_slots(t_res);
+    return node;
+}
+
+/*
+ * The io_uring engine: keeps up to URING_PREFETCH dequeued directories being
+ * opened while it scans another one, as far as the fd budget allows, and
+ * submits the statx of all the entries of unknown type in a getdents64 buffer
+ * at once. It only sleeps for a directory to be queued when it has none
+ * prefetched.
+ */
+void uring_scan_dirs(char *dents, struct thread_resources *t_res) {
+    size_t nread, pos;
+    char *dir_name;
+    struct dnode *curr_node;
+    struct linux_dirent64 *dir_ent;
+    while (true) {
+        while (t_res->prefetched < URING_PREFETCH &&
+               (curr_node = prefetch_dir(t_res))) {
+            ++t_res->prefetched;
+            uring_open(curr_node, t_res);
+        }
+        if (!t_res->prefetched) return;
+        uring_reap(0, t_res);
+        while (TAILQ_EMPTY(&t_res->ready)) uring_reap(1, t_res);
+        curr_node = TAILQ_FIRST(&t_res->ready);
+        TAILQ_REMOVE(&t_res->ready, curr_node, queue_node);
+        --t_res->prefetched;
+        t_res->curr_node = curr_node;
+        t_res->holds_fd = curr_node->fd >= 0;
+        if (!t_res->holds_fd) replay_dir(t_res);
+        while (t_res->holds_fd &&
+               (nread = safe_getdents(curr_node->fd, dents, t_res))) {
+            for (pos = 0; pos < nread; pos += dir_ent->d_reclen) {
+                dir_ent = (struct linux_dirent64 *)(dents + pos);
+                dir_name = dir_ent->d_name;
+                if (!is_regular_directory(dir_name)) continue;
+                if (entry_needs_stat(dir_name, dir_ent->d_type))
+                    uring_stat(dir_name, t_res);
+                else
+                    handle_entry(dir_name, dir_ent->d_type, NULL, t_res);
             }
+            /* The names are in dents until the next getdents64 */
+            while (t_res->statx_pending) uring_reap(1, t_res);
         }
+        if (global.index_path) list_dir(t_res);
+        finish_dir(t_res);
         safe_thread_resources_dtor(t_res);
-        if (tid == INIT_THREADNO) {
-            tid = INIT_FINISHED_THREADNO;
-            t_res->tid = INIT_FINISHED_THREADNO;
+        release_fd_slots(t_res);
+    }
+}
+
+/*
+ * This is the computation of a thread: taking a directory from the deques,
+ * searching for the term in the file names for that directory, and pushing
+ * directories in that directory to its own deque, until no directory is left
+ * queued or being scanned by any thread. The file names are matched against
+ * all the search patterns at once.
+ */
+bool scan_dir(void *tid_arg) {
+    unsigned int tid = (unsigned int)(intptr_t)(tid_arg);
+    _Alignas(struct linux_dirent64) char dents[DENTS_BUF_SIZE];
+    struct thread_resources *t_res = safe_thread_resources_ctor(tid);
+    pthread_cleanup_push(safe_thread_resources_free, t_res);
+    if (global.engine == ENGINE_URING && uring_setup(t_res))
+        uring_scan_dirs(dents, t_res);
+    else
+        sync_scan_dirs(dents, t_res);
+    pthread_cleanup_pop(true);
+    pthread_exit((void *)EXIT_SUCCESS);
+}
+
+unsigned long found_files() {
+    unsigned long found = 0;
+    for (unsigned int i = 0; i < global.max_thread_number; ++i)
+        found += atomic_load_explicit(&global.counters[i].found,
+                                      memory_order_relaxed);
+    return found;
+}
+
+unsigned long load_counter(atomic_ulong *counter) {
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+/*
+ * Prints the counters of all the threads, the queue depths sampled so far and
+ * the stat latency histogram to stderr. The counters are read as they are, so
+ * a report taken during the search is only about consistent.
+ */
+void report_stats() {
+    struct thread_counters *counters;
+    unsigned long dirs, entries, asleep, lock_wait, contended;
+    unsigned long total[5] = {0}, stat_latency[STAT_BUCKETS] = {0};
+    unsigned long sum = 0, nstats = 0;
+    unsigned int min = UINT_MAX, max = 0, column;
+    size_t span;
+    fprintf(stderr, "pfind stats after %.3f s\n",
+            (double)(now_ns() - global.start) / 1e9);
+    fprintf(stderr, "%6s %10s %12s %10s %13s %10s\n", "thread", "dirs",
+            "entries", "asleep ms", "lock wait ms", "contended");
+    for (unsigned int i = 0; i < global.max_thread_number; ++i) {
+        counters = &global.counters[i];
+        total[0] += dirs = load_counter(&counters->dirs);
+        total[1] += entries = load_counter(&counters->entries);
+        total[2] += asleep = load_counter(&counters->asleep);
+        total[3] += lock_wait = load_counter(&counters->lock_wait);
+        total[4] += contended = load_counter(&counters->contended);
+        for (unsigned int j = 0; j < STAT_BUCKETS; ++j)
+            stat_latency[j] += load_counter(&counters->stat_latency[j]);
+        fprintf(stderr, "%6u %10lu %12lu %10.1f %13.1f %10lu\n", i, dirs,
+                entries, (double)asleep / 1e6, (double)lock_wait / 1e6,
+                contended);
+    }
+    fprintf(stderr, "%6s %10lu %12lu %10.1f %13.1f %10lu\n", "total",
+            total[0], total[1], (double)total[2] / 1e6,
+            (double)total[3] / 1e6, total[4]);
+    if (global.auto_threads)
+        fprintf(stderr, "active threads: %u of %u\n",
+                atomic_load(&global.active), global.max_thread_number);
+    if (global.ndepths) {
+        for (size_t i = 0; i < global.ndepths; ++i) {
+            sum += global.depths[i];
+            if (global.depths[i] < min) min = global.depths[i];
+            if (global.depths[i] > max) max = global.depths[i];
         }
+        fprintf(stderr,
+                "queue depth, %zu samples %d ms apart: "
+                "min %u avg %.1f max %u\n",
+                global.ndepths, SAMPLE_NS / 1000000, min,
+                (double)sum / (double)global.ndepths, max);
+        /* Each column is the max of span samples */
+        span = (global.ndepths + DEPTH_COLUMNS - 1) / DEPTH_COLUMNS;
+        for (size_t i = 0; i < global.ndepths; i += span) {
+            column = 0;
+            for (size_t j = i; j < i + span && j < global.ndepths; ++j)
+                if (global.depths[j] > column) column = global.depths[j];
+            fprintf(stderr, " %u", column);
+        }
+        fputc('\n', stderr);
     }
+    for (unsigned int i = 0; i < STAT_BUCKETS; ++i) nstats += stat_latency[i];
+    /* None when the file system reports the entry types */
+    fprintf(stderr, "stat latency, %lu stats\n", nstats);
+    for (unsigned int i = 0; i < STAT_BUCKETS; ++i)
+        if (stat_latency[i])
+            fprintf(stderr, "  < %12llu ns %10lu\n", 2ULL << i,
+                    stat_latency[i]);
+}
+
+/*
+ * Runs with --stats, as the only thread SIGUSR1 is not blocked for: samples
+ * the queue depth every SAMPLE_NS, and reports on SIGUSR1, until the search
+ * is done.
+ */
+void *sample_stats(void *arg) {
+    struct timespec timeout = {0, SAMPLE_NS};
+    sigset_t set;
+    (void)arg;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    while (!atomic_load(&global.done)) {
+        if (sigtimedwait(&set, NULL, &timeout) == SIGUSR1) {
+            report_stats();
+            continue;
+        }
+        if (global.ndepths == global.depths_size) {
+            global.depths_size = global.depths_size ? global.depths_size * 2
+                                                    : 1024;
+            global.depths = realloc(global.depths, global.depths_size *
+                                                       sizeof(unsigned int));
+            if (global.depths == NULL) {
+                perror("realloc failed");
+                exit(EXIT_FAILURE);
+            }
+        }
+        global.depths[global.ndepths++] = atomic_load(&global.queued);
+    }
+    return NULL;
+}
+
+uint64_t cpu_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * Runs in auto mode: every ADAPT_NS, lets more threads take directories while
+ * more are queued than there are active threads and these leave CPUs idle,
+ * waiting for I/O, and fewer while the CPUs are all busy, as more threads
+ * would only contend for them.
+ */
+void *adapt_threads(void *arg) {
+    struct timespec interval = {0, ADAPT_NS};
+    uint64_t wall = now_ns(), cpu = cpu_ns(), wall_then, cpu_then;
+    unsigned int active, ncpus = global.topo.ncpus;
+    double busy; /* CPUs' worth of time the process used */
+    (void)arg;
+    while (!atomic_load(&global.done)) {
+        nanosleep(&interval, NULL);
+        wall_then = wall;
+        cpu_then = cpu;
+        wall = now_ns();
+        cpu = cpu_ns();
+        busy = (double)(cpu - cpu_then) / (double)(wall - wall_then);
+        active = atomic_load(&global.active);
+        if (atomic_load(&global.queued) > active &&
+            active < global.max_thread_number &&
+            busy < 0.8 * (active < ncpus ? active : ncpus)) {
+            active += (active + 3) / 4;
+            if (active > global.max_thread_number)
+                active = global.max_thread_number;
+            pthread_mutex_lock(&global.nonempty_cond_lock);
+            atomic_store(&global.active, active);
+            pthread_cond_broadcast(&global.active_cond);
+            pthread_mutex_unlock(&global.nonempty_cond_lock);
+        } else if (active > ncpus && busy > 0.9 * ncpus) {
+            atomic_store(&global.active, active - (active - ncpus + 3) / 4);
+        }
+    }
+    return NULL;
 }
 
 void handler() {
-    printf("Search stopped, found %d files\n", global.found_counter);
+    fprintf(global.summary, "Search stopped, found %lu files\n",
+            found_files());
     exit(EXIT_SUCCESS);
 }
 
+/*
+ * Orders the threads each thread steals from: those whose CPUs are on its
+ * NUMA node, then the others, each in a round robin from it
+ */
+void init_victims() {
+    unsigned int n = global.max_thread_number, *victims, v, k;
+    int *node = malloc(n * sizeof(int));
+    /* + 1, as there are none for a single thread */
+    global.victims = malloc((size_t)n * (n - 1) * sizeof(unsigned int) + 1);
+    if (node == NULL || global.victims == NULL) {
+        perror("malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    for (unsigned int t = 0; t < n; ++t)
+        node[t] = global.topo.nodes[topology_slot(&global.topo, t, n)];
+    for (unsigned int t = 0; t < n; ++t) {
+        victims = &global.victims[(size_t)t * (n - 1)];
+        k = 0;
+        for (unsigned int i = 1; i < n; ++i)
+            if (node[v = (t + i) % n] == node[t]) victims[k++] = v;
+        for (unsigned int i = 1; i < n; ++i)
+            if (node[v = (t + i) % n] != node[t]) victims[k++] = v;
+    }
+    free(node);
+}
+
+/*
+ * Allocates a deque, an arena and counters per thread, and queues the search
+ * root on the first deque.
+ */
+void init_deques() {
+    size_t root_len = strlen(global.init_dir_name);
+    struct dnode *root = malloc(sizeof(struct dnode) + root_len + 1);
+    global.deques = aligned_alloc(
+        CACHE_LINE, global.max_thread_number * sizeof(struct deque));
+    global.arenas = aligned_alloc(
+        CACHE_LINE, global.max_thread_number * sizeof(struct arena));
+    global.counters = aligned_alloc(
+        CACHE_LINE, global.max_thread_number * sizeof(struct thread_counters));
+    if (root == NULL || global.deques == NULL || global.arenas == NULL ||
+        global.counters == NULL) {
+        perror("malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    for (unsigned int i = 0; i < global.max_thread_number; ++i) {
+        if (pthread_mutex_init(&global.deques[i].lock, NULL)) {
+            perror("pthread_mutex_init failed");
+            exit(EXIT_FAILURE);
+        }
+        TAILQ_INIT(&global.deques[i].head);
+        global.arenas[i] = (struct arena){NULL, 0};
+        memset(&global.counters[i], 0, sizeof(struct thread_counters));
+    }
+    root->parent = NULL;
+    root->path_len = root->name_len = root_len;
+    root->fd = -1;
+    atomic_init(&root->fd_refs, 0);
+    atomic_init(&root->unopened, 1);
+    root->held = false;
+    root->index_dir = global.index.ndirs ? 0 : INDEX_NO_DIR;
+    root->listing = NULL;
+    memcpy(root->name, global.init_dir_name, root_len + 1);
+    global.root = root;
+#ifdef PFIND_QUEUE_MPMC
+    if (mpmc_init(&global.ring, MPMC_SIZE) < 0) {
+        perror("malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    atomic_init(&global.overflowed, 0);
+    atomic_init(&global.wake_seq, 0);
+    mpmc_push(&global.ring, root);
+#else
+    TAILQ_INSERT_TAIL(&global.deques[ROOT_THREADNO].head, root, queue_node);
+#endif
+    atomic_init(&global.queued, 1);
+    atomic_init(&global.pending, 1);
+    atomic_init(&global.asleep_counter, 0);
+    atomic_init(&global.held_fds, 0);
+    init_victims();
+}
+
+void *grow(void *array, size_t *size, size_t elem_size) {
+    *size = *size ? *size * 2 : 1024;
+    if ((array = realloc(array, *size * elem_size)) == NULL) {
+        perror("realloc failed");
+        exit(EXIT_FAILURE);
+    }
+    return array;
+}
+
+int compare_listed(const void *a, const void *b) {
+    return strcmp(((const struct listed_entry *)a)->name,
+                  ((const struct listed_entry *)b)->name);
+}
+
+/*
+ * Writes the new index from the listings of all the directories, numbered in
+ * BFS order from the search root, with their entries sorted by name. The old
+ * index is unmapped after, as names of directories listed from it are there.
+ */
+void write_index() {
+    struct dnode **nodes = NULL;
+    struct index_dir *dirs = NULL;
+    struct index_entry *entries = NULL;
+    char *names = NULL;
+    size_t nodes_size = 0, dirs_size = 0, entries_size = 0, names_size = 0;
+    size_t ndirs = 1, nentries = 0, names_len = 0, len;
+    struct listing *listing;
+    struct listed_entry *listed;
+    nodes = grow(nodes, &nodes_size, sizeof(*nodes));
+    nodes[0] = global.root;
+    for (size_t i = 0; i < ndirs; ++i) {
+        listing = nodes[i]->listing;
+        qsort(listing->entries, listing->n, sizeof(struct listed_entry),
+              compare_listed);
+        if (i == dirs_size) dirs = grow(dirs, &dirs_size, sizeof(*dirs));
+        dirs[i] = (struct index_dir){.mtime_sec = nodes[i]->mtime_sec,
+                                     .mtime_nsec = nodes[i]->mtime_nsec,
+                                     .nentries = (uint32_t)listing->n,
+                                     .first_entry = nentries};
+        for (size_t j = 0; j < listing->n; ++j, ++nentries) {
+            listed = &listing->entries[j];
+            len = strlen(listed->name) + 1;
+            while (names_len + len > names_size)
+                names = grow(names, &names_size, 1);
+            memcpy(names + names_len, listed->name, len);
+            if (nentries == entries_size)
+                entries = grow(entries, &entries_size, sizeof(*entries));
+            entries[nentries] = (struct index_entry){
+                .name = names_len, .dir = INDEX_NO_DIR, .type = listed->type};
+            names_len += len;
+            if (listed->child == NULL) continue;
+            if (ndirs == nodes_size)
+                nodes = grow(nodes, &nodes_size, sizeof(*nodes));
+            entries[nentries].dir = (uint32_t)ndirs;
+            nodes[ndirs++] = listed->child;
+        }
+    }
+    if (index_write(global.index_path, global.init_dir_name, dirs,
+                    (uint32_t)ndirs, entries, nentries, names,
+                    names_len) < 0)
+        perror("cannot write the index");
+    if (global.index.ndirs) index_close(&global.index);
+    free(nodes);
+    free(dirs);
+    free(entries);
+    free(names);
+}
+
+/*
+ * Frees all the dnodes at once, after all the threads are done with them
+ */
+void release_arenas() {
+    struct arena_chunk *chunk, *next;
+    for (unsigned int i = 0; i < global.max_thread_number; ++i)
+        for (chunk = global.arenas[i].chunks; chunk != NULL; chunk = next) {
+            next = chunk->next;
+            free(chunk);
+        }
+    free(global.arenas);
+    free(global.root);
+}
+
 void parallel_find() {
-    bool all_threads_failed = true;
-    pthread_t threads[global.max_thread_number];
+    bool all_threads_failed = true, some_thread_failed = false;
+    pthread_t threads[global.max_thread_number], sampler, adapter;
+    cpu_set_t cpu;
+    sigset_t set;
     pthread_attr_t attr;
     pthread_attr_init(&attr);
     struct sigaction sig_action;
+    init_deques(); /* Before the handler may read the counters */
     sig_action.sa_handler = handler;
     sigemptyset(&sig_action.sa_mask);
     sig_action.sa_flags = 0;
@@ -253,14 +1658,31 @@ void parallel_find() {
         perror("sigaction failed");
         exit(EXIT_FAILURE);
     }
-    pthread_create(&threads[0], &attr, (void *)scan_dir,
-                   (void *)(intptr_t)INIT_THREADNO);
-    /* Initialization. The arg = i + 1 is because we used tid 1 for the init
-     * thread after the init stage  */
-    for (unsigned int i = INIT_FINISHED_THREADNO; i < global.max_thread_number;
-         ++i) {
+    if (global.stats) { /* The threads inherit the mask, but the sampler */
+        sigemptyset(&set);
+        sigaddset(&set, SIGUSR1);
+        global.start = now_ns();
+        if (pthread_sigmask(SIG_BLOCK, &set, NULL) ||
+            pthread_create(&sampler, &attr, sample_stats, NULL)) {
+            perror("cannot start the stats sampler");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (global.auto_threads &&
+        pthread_create(&adapter, &attr, adapt_threads, NULL)) {
+        perror("cannot start the thread count adapter");
+        exit(EXIT_FAILURE);
+    }
+    for (unsigned int i = 0; i < global.max_thread_number; ++i) {
+        if (global.pin) {
+            CPU_ZERO(&cpu);
+            CPU_SET(global.topo.cpus[topology_slot(
+                        &global.topo, i, global.max_thread_number)],
+                    &cpu);
+            pthread_attr_setaffinity_np(&attr, sizeof(cpu), &cpu);
+        }
         if (pthread_create(&threads[i], &attr, (void *)scan_dir,
-                           (void *)(intptr_t)(i + 1))) {
+                           (void *)(intptr_t)i)) {
             fprintf(stderr, "pthread_create failed for thread %u: %s\n", i,
                     strerror(errno));
             exit(EXIT_FAILURE);
@@ -273,36 +1695,267 @@ void parallel_find() {
                     strerror(errno));
             exit(EXIT_FAILURE);
         }
-        if ((int)(intptr_t)t_ret_val == 0) all_threads_failed = false;
+        if ((int)(intptr_t)t_ret_val == 0)
+            all_threads_failed = false;
+        else
+            some_thread_failed = true;
+    }
+    atomic_store(&global.done, true);
+    if (global.auto_threads) pthread_join(adapter, NULL);
+    if (global.index_path && !some_thread_failed) /* Or else it is partial */
+        write_index();
+    release_arenas();
+    matcher_free(&global.matcher);
+#ifdef PFIND_QUEUE_MPMC
+    mpmc_free(&global.ring);
+#endif
+    fprintf(global.summary, "Done searching, found %lu files\n",
+            found_files());
+    if (global.stats) {
+        pthread_join(sampler, NULL);
+        fflush(global.summary);
+        report_stats();
+        free(global.depths);
     }
-    printf("Done searching, found %d files\n", global.found_counter);
     exit(all_threads_failed);
 }
 
+/*
+ * Parses a positive number out of arg, or exits with the message what
+ */
+unsigned int parse_count(char *arg, char *what) {
+    char *end;
+    unsigned long count;
+    errno = 0;
+    count = strtoul(arg, &end, 10);
+    if (errno || end == arg || *end || count == 0 || count > UINT_MAX) {
+        errno = EINVAL;
+        perror(what);
+        exit(EXIT_FAILURE);
+    }
+    return (unsigned int)count;
+}
+
+/*
+ * The default fd budget is what the process may open, but a few descriptors
+ */
+unsigned int default_fd_budget() {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) < 0) {
+        perror("getrlimit failed");
+        exit(EXIT_FAILURE);
+    }
+    if (limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur > UINT_MAX)
+        return UINT_MAX;
+    return limit.rlim_cur > FD_RESERVE ? limit.rlim_cur - FD_RESERVE : 1;
+}
+
+void add_pattern(char *pattern) {
+    char **patterns =
+        realloc(global.patterns, (global.npatterns + 1) * sizeof(char *));
+    if (patterns == NULL) {
+        perror("realloc failed");
+        exit(EXIT_FAILURE);
+    }
+    global.patterns = patterns;
+    global.patterns[global.npatterns++] = pattern;
+}
+
+/*
+ * Adds the patterns in the file at path, one per line. Empty lines are
+ * skipped.
+ */
+void read_pattern_file(char *path) {
+    FILE *file = fopen(path, "r");
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    if (file == NULL) {
+        perror("cannot open pattern file");
+        exit(EXIT_FAILURE);
+    }
+    while ((len = getline(&line, &size, file)) >= 0) {
+        if (len && line[len - 1] == '\n') line[--len] = '\0';
+        if (!len) continue;
+        add_pattern(line);
+        line = NULL;
+        size = 0;
+    }
+    free(line);
+    if (ferror(file)) {
+        perror("cannot read pattern file");
+        exit(EXIT_FAILURE);
+    }
+    fclose(file);
+}
+
+static struct option long_options[] = {
+    {"fd-budget", required_argument, NULL, 'b'},
+    {"pattern-file", required_argument, NULL, 'f'},
+    {"ignore-case", no_argument, NULL, 'i'},
+    {"glob", no_argument, NULL, 'g'},
+    {"print0", no_argument, NULL, '0'},
+    {"engine", required_argument, NULL, 'e'},
+    {"stats", no_argument, NULL, 's'},
+    {"type", required_argument, NULL, 't'},
+    {"size", required_argument, NULL, 'z'},
+    {"mtime", required_argument, NULL, 'm'},
+    {"newer", required_argument, NULL, 'n'},
+    {"index", required_argument, NULL, 'x'},
+    {"pin", no_argument, NULL, 'p'},
+    {NULL, 0, NULL, 0}};
+
+/*
+ * The predicates are written with a single dash, as in find, which
+ * getopt_long would take for short options, so those arguments are given
+ * their long options' two dashes, up to a "--"
+ */
+void dash_predicates(int argc, char *argv[]) {
+    static char *const predicates[][2] = {{"-type", "--type"},
+                                          {"-size", "--size"},
+                                          {"-mtime", "--mtime"},
+                                          {"-newer", "--newer"}};
+    for (int i = 1; i < argc && strcmp(argv[i], "--"); ++i)
+        for (size_t j = 0; j < sizeof(predicates) / sizeof(*predicates); ++j)
+            if (!strcmp(argv[i], predicates[j][0])) argv[i] = predicates[j][1];
+}
+
+/*
+ * The search term may be left out when a pattern file is given. Long options
+ * only match with two dashes, so that no prefix of one is mistaken for
+ * another, and a search term starting with '-' goes after a "--".
+ */
 void handle_args(int argc, char *argv[]) {
-    if (argc != ARG_NUM) {
+    int opt;
+    bool has_pattern_file = false;
+    global.fd_budget = default_fd_budget();
+    global.summary = stdout;
+    pred_init(&global.preds);
+    dash_predicates(argc, argv);
+    while ((opt = getopt_long(argc, argv, "0", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'b':
+            global.fd_budget = parse_count(optarg, "invalid fd budget");
+            break;
+        case 'f':
+            read_pattern_file(optarg);
+            has_pattern_file = true;
+            break;
+        case 'i':
+            global.match_flags |= MATCH_IGNORE_CASE;
+            break;
+        case 'g':
+            global.match_flags |= MATCH_GLOB;
+            break;
+        case 'e':
+            if (!strcmp(optarg, "sync")) {
+                global.engine = ENGINE_SYNC;
+            } else if (!strcmp(optarg, "uring")) {
+                global.engine = ENGINE_URING;
+            } else {
+                errno = EINVAL;
+                perror("invalid engine");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 's':
+            global.stats = true;
+            break;
+        case 't':
+            if (pred_set_type(&global.preds, optarg) < 0) {
+                perror("invalid -type");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'z':
+            if (pred_set_size(&global.preds, optarg) < 0) {
+                perror("invalid -size");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'm':
+            if (pred_set_mtime(&global.preds, optarg) < 0) {
+                perror("invalid -mtime");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'n':
+            if (pred_set_newer(&global.preds, optarg) < 0) {
+                perror("cannot stat the -newer file");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'x':
+            global.index_path = optarg;
+            break;
+        case 'p':
+            global.pin = true;
+            break;
+        case '0': /* Keep stdout to the paths, for xargs -0 */
+            global.separator = '\0';
+            global.summary = stderr;
+            break;
+        default:
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (argc - optind != ARG_NUM &&
+        !(has_pattern_file && argc - optind == ARG_NUM - 1)) {
         errno = EINVAL;
         perror("invalid number of arguments");
         exit(EXIT_FAILURE);
     }
-    if (!(global.init_dir = opendir(argv[1]))) {
+    argv += optind - 1; /* So the positional arguments start at argv[1] */
+    if ((global.init_dir = open(argv[1], DIR_OPEN_FLAGS & ~O_NOFOLLOW)) < 0) {
         errno = EINVAL;
         perror("not a searchable directory");
         exit(EXIT_FAILURE);
     }
-    if (pthread_mutex_init(&global.queue_lock, NULL) ||
-        pthread_mutex_init(&global.nonempty_cond_lock, NULL) ||
-        pthread_mutex_init(&global.found_counter_lock, NULL)) {
+    if (pthread_mutex_init(&global.nonempty_cond_lock, NULL) ||
+        pthread_mutex_init(&global.output_lock, NULL)) {
         perror("pthread_mutex_init failed");
         exit(EXIT_FAILURE);
     }
-    if (pthread_cond_init(&global.nonempty_cond, NULL)) {
+    if (pthread_cond_init(&global.nonempty_cond, NULL) ||
+        pthread_cond_init(&global.active_cond, NULL)) {
         perror("pthread_mutex_init failed");
         exit(EXIT_FAILURE);
     }
     global.init_dir_name = argv[1];
-    global.sterm = argv[2];
-    global.max_thread_number = (unsigned int)atoi(argv[3]);
+    if (global.index_path &&
+        index_open(&global.index, global.index_path, global.init_dir_name) <
+            0 &&
+        errno != ENOENT) /* Or else it is written for the first time */
+        fprintf(stderr, "ignoring the index %s: %s\n", global.index_path,
+                strerror(errno));
+    if (argc - optind == ARG_NUM) add_pattern(argv[2]);
+    if (topology_init(&global.topo) < 0) {
+        perror("cannot read the CPU topology");
+        exit(EXIT_FAILURE);
+    }
+    /* The last positional argument */
+    if (!strcmp(argv[argc - optind], "auto")) {
+        global.auto_threads = true;
+        global.max_thread_number = AUTO_THREADS_PER_CPU * global.topo.ncpus;
+        if (global.max_thread_number > global.fd_budget)
+            global.max_thread_number = global.fd_budget;
+    } else {
+        global.max_thread_number =
+            parse_count(argv[argc - optind], "invalid number of threads");
+    }
+    atomic_init(&global.active, global.max_thread_number);
+    if (global.auto_threads && global.topo.ncpus < global.max_thread_number)
+        atomic_store(&global.active, global.topo.ncpus); /* To start with */
+    if (global.fd_budget < global.max_thread_number) {
+        errno = EINVAL;
+        perror("fd budget is below the number of threads");
+        exit(EXIT_FAILURE);
+    }
+    if (matcher_init(&global.matcher, global.patterns, global.npatterns,
+                     global.match_flags) < 0) {
+        perror("cannot build the pattern matcher");
+        exit(EXIT_FAILURE);
+    }
 }
 
 int main(int argc, char *argv[]) {
@@ -0,0 +1,132 @@
+#define _GNU_SOURCE
+
+#include "pred.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SECONDS_PER_DAY (24 * 60 * 60)
+
+void pred_init(struct predicates *p) {
+    *p = (struct predicates){.types = ~(1u << DT_DIR), .now = time(NULL)};
+}
+
+static int type_of_letter(char letter) {
+    switch (letter) {
+    case 'b': return DT_BLK;
+    case 'c': return DT_CHR;
+    case 'd': return DT_DIR;
+    case 'p': return DT_FIFO;
+    case 'f': return DT_REG;
+    case 'l': return DT_LNK;
+    case 's': return DT_SOCK;
+    default: return -1;
+    }
+}
+
+int pred_set_type(struct predicates *p, const char *arg) {
+    unsigned int types = 0;
+    int type;
+    while (true) {
+        if ((type = type_of_letter(*arg)) < 0 ||
+            (arg[1] != ',' && arg[1] != '\0')) {
+            errno = EINVAL;
+            return -1;
+        }
+        types |= 1u << type;
+        if (arg[1] == '\0') break;
+        arg += 2;
+    }
+    p->types = types;
+    return 0;
+}
+
+/*
+ * Parses [+-]N, and leaves *end at what follows N
+ */
+static int parse_compared(const char *arg, char *cmp, uint64_t *n,
+                          char **end) {
+    *cmp = *arg == '+' || *arg == '-' ? *arg++ : '\0';
+    if (*arg < '0' || *arg > '9') {
+        errno = EINVAL;
+        return -1;
+    }
+    errno = 0;
+    *n = strtoull(arg, end, 10);
+    return errno ? -1 : 0;
+}
+
+int pred_set_size(struct predicates *p, const char *arg) {
+    char *end;
+    if (parse_compared(arg, &p->size_cmp, &p->size, &end) < 0) return -1;
+    switch (*end) {
+    case 'c': p->size_unit = 1; break;
+    case 'w': p->size_unit = 2; break;
+    case '\0':
+    case 'b': p->size_unit = 512; break;
+    case 'k': p->size_unit = 1024; break;
+    case 'M': p->size_unit = 1024 * 1024; break;
+    case 'G': p->size_unit = 1024 * 1024 * 1024; break;
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+    if (*end && end[1]) {
+        errno = EINVAL;
+        return -1;
+    }
+    p->stat_mask |= STATX_SIZE;
+    return 0;
+}
+
+int pred_set_mtime(struct predicates *p, const char *arg) {
+    char *end;
+    if (parse_compared(arg, &p->mtime_cmp, &p->mtime_days, &end) < 0)
+        return -1;
+    if (*end) {
+        errno = EINVAL;
+        return -1;
+    }
+    p->mtime = true;
+    p->stat_mask |= STATX_MTIME;
+    return 0;
+}
+
+int pred_set_newer(struct predicates *p, const char *path) {
+    struct statx stx;
+    if (statx(AT_FDCWD, path, 0, STATX_MTIME, &stx) < 0) return -1;
+    p->newer = true;
+    p->newer_than = stx.stx_mtime;
+    p->stat_mask |= STATX_MTIME;
+    return 0;
+}
+
+static bool compare(char cmp, int64_t value, int64_t n) {
+    return cmp == '+' ? value > n : cmp == '-' ? value < n : value == n;
+}
+
+/*
+ * As in find, sizes are rounded up to the unit, and ages down to days
+ */
+bool pred_match(const struct predicates *p, const struct statx *stx) {
+    int64_t age, days;
+    if ((p->stat_mask & STATX_SIZE) &&
+        !compare(p->size_cmp,
+                 (int64_t)((stx->stx_size + p->size_unit - 1) / p->size_unit),
+                 (int64_t)p->size))
+        return false;
+    if (p->mtime) {
+        age = (int64_t)p->now - stx->stx_mtime.tv_sec;
+        days = age >= 0 ? age / SECONDS_PER_DAY
+                        : -((-age + SECONDS_PER_DAY - 1) / SECONDS_PER_DAY);
+        if (!compare(p->mtime_cmp, days, (int64_t)p->mtime_days)) return false;
+    }
+    if (p->newer && !(stx->stx_mtime.tv_sec > p->newer_than.tv_sec ||
+                      (stx->stx_mtime.tv_sec == p->newer_than.tv_sec &&
+                       stx->stx_mtime.tv_nsec > p->newer_than.tv_nsec)))
+        return false;
+    return true;
+}
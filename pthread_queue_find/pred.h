@@ -0,0 +1,52 @@
+#ifndef PRED_H
+#define PRED_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <time.h>
+
+/*
+ * find-style predicates on the entries printed besides their names. The type
+ * is decided from d_type when getdents64 reports it, and the others from a
+ * statx of stat_mask, which is 0 when no such predicate is given, so that
+ * entries are only stat'ed when some predicate needs it.
+ */
+struct predicates {
+    unsigned int types;     /* Bit 1 << DT_* of each type printed */
+    unsigned int stat_mask; /* What the predicates but the type need */
+    char size_cmp;          /* '+', '-', or '\0' for an exact size */
+    uint64_t size, size_unit;
+    bool mtime;
+    char mtime_cmp;
+    uint64_t mtime_days;
+    bool newer;
+    struct statx_timestamp newer_than;
+    time_t now; /* When the search started, for -mtime */
+};
+
+/*
+ * Sets up predicates that select every entry but directories, as pfind
+ * always did
+ */
+void pred_init(struct predicates *p);
+
+/*
+ * Each parses the argument of the option of its name, -type being a comma
+ * separated list of find's type letters. Return 0, or -1 and set errno.
+ */
+int pred_set_type(struct predicates *p, const char *arg);
+int pred_set_size(struct predicates *p, const char *arg);
+int pred_set_mtime(struct predicates *p, const char *arg);
+int pred_set_newer(struct predicates *p, const char *path);
+
+static inline bool pred_type(const struct predicates *p, unsigned char type) {
+    return p->types & (1u << type);
+}
+
+/*
+ * Evaluates all the predicates but the type on the statx of an entry
+ */
+bool pred_match(const struct predicates *p, const struct statx *stx);
+
+#endif
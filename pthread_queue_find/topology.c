@@ -0,0 +1,90 @@
+#define _GNU_SOURCE
+
+#include "topology.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NODE_DIR "/sys/devices/system/node"
+
+/*
+ * Sets the node of every CPU of a cpulist such as "0-3,8-11" that is in cpus
+ */
+static void read_cpulist(FILE *file, int node, const int *cpus,
+                         unsigned int ncpus, int *nodes) {
+    int first, last;
+    char sep;
+    while (fscanf(file, "%d", &first) == 1) {
+        last = first;
+        if ((sep = (char)fgetc(file)) == '-') {
+            if (fscanf(file, "%d", &last) != 1) return;
+            sep = (char)fgetc(file);
+        }
+        for (unsigned int i = 0; i < ncpus; ++i)
+            if (cpus[i] >= first && cpus[i] <= last) nodes[i] = node;
+        if (sep != ',') return;
+    }
+}
+
+static void read_nodes(const int *cpus, unsigned int ncpus, int *nodes) {
+    char path[PATH_MAX];
+    struct dirent *ent;
+    FILE *file;
+    int node;
+    DIR *dir = opendir(NODE_DIR);
+    if (dir == NULL) return; /* No NUMA: all on node 0 */
+    while ((ent = readdir(dir)) != NULL) {
+        if (sscanf(ent->d_name, "node%d", &node) != 1) continue;
+        snprintf(path, sizeof(path), NODE_DIR "/%s/cpulist", ent->d_name);
+        if ((file = fopen(path, "re")) == NULL) continue;
+        read_cpulist(file, node, cpus, ncpus, nodes);
+        fclose(file);
+    }
+    closedir(dir);
+}
+
+int topology_init(struct topology *topo) {
+    cpu_set_t set;
+    unsigned int n = 0;
+    int cpu, node;
+    *topo = (struct topology){0};
+    if (sched_getaffinity(0, sizeof(set), &set) < 0) return -1;
+    topo->ncpus = (unsigned int)CPU_COUNT(&set);
+    topo->cpus = malloc(topo->ncpus * sizeof(int));
+    topo->nodes = calloc(topo->ncpus, sizeof(int));
+    if (topo->cpus == NULL || topo->nodes == NULL) {
+        topology_free(topo);
+        return -1;
+    }
+    for (cpu = 0; cpu < CPU_SETSIZE && n < topo->ncpus; ++cpu)
+        if (CPU_ISSET(cpu, &set)) topo->cpus[n++] = cpu;
+    read_nodes(topo->cpus, topo->ncpus, topo->nodes);
+    /* Insertion sort by node, stable so each node's CPUs stay in order */
+    for (unsigned int i = 1; i < topo->ncpus; ++i) {
+        cpu = topo->cpus[i];
+        node = topo->nodes[i];
+        for (n = i; n > 0 && topo->nodes[n - 1] > node; --n) {
+            topo->cpus[n] = topo->cpus[n - 1];
+            topo->nodes[n] = topo->nodes[n - 1];
+        }
+        topo->cpus[n] = cpu;
+        topo->nodes[n] = node;
+    }
+    return 0;
+}
+
+void topology_free(struct topology *topo) {
+    free(topo->cpus);
+    free(topo->nodes);
+    topo->cpus = topo->nodes = NULL;
+}
+
+unsigned int topology_slot(const struct topology *topo, unsigned int tid,
+                           unsigned int nthreads) {
+    return (unsigned int)((unsigned long)tid * topo->ncpus / nthreads);
+}
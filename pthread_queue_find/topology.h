@@ -0,0 +1,29 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+/*
+ * The CPUs this process may run on, ordered by NUMA node, as read from
+ * /sys/devices/system/node. Without NUMA information, they are all on node 0.
+ */
+struct topology {
+    unsigned int ncpus;
+    int *cpus;  /* Sorted by node, then by number */
+    int *nodes; /* The node of each of cpus */
+};
+
+/*
+ * Returns 0, or -1 and sets errno
+ */
+int topology_init(struct topology *topo);
+
+void topology_free(struct topology *topo);
+
+/*
+ * Returns the index in cpus of the CPU thread tid of nthreads runs on: the
+ * threads are spread evenly over the CPUs in their order, so consecutive
+ * threads share a node.
+ */
+unsigned int topology_slot(const struct topology *topo, unsigned int tid,
+                           unsigned int nthreads);
+
+#endif
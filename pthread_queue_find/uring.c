@@ -0,0 +1,135 @@
+#define _GNU_SOURCE
+
+#include "uring.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* The kernel reads the SQ tail and writes the CQ tail concurrently */
+#define load_acquire(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+static void *map_ring(int fd, size_t size, off_t offset) {
+    return mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                fd, offset);
+}
+
+static unsigned int *ring_field(void *ring, unsigned int offset) {
+    return (unsigned int *)((char *)ring + offset);
+}
+
+int uring_init(struct uring *ring, unsigned int entries) {
+    struct io_uring_params params;
+    int saved_errno;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+    ring->sq_ring = ring->cq_ring = ring->sqes = MAP_FAILED;
+    if ((ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params)) < 0)
+        return -1;
+    ring->sq_entries = params.sq_entries;
+    ring->sq_ring_size =
+        params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size =
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = map_ring(ring->fd, ring->sq_ring_size, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) goto fail;
+    ring->cq_ring = params.features & IORING_FEAT_SINGLE_MMAP
+                        ? ring->sq_ring
+                        : map_ring(ring->fd, ring->cq_ring_size,
+                                   IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED) goto fail;
+    ring->sqes = map_ring(ring->fd, ring->sqes_size, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) goto fail;
+    ring->sq_head = ring_field(ring->sq_ring, params.sq_off.head);
+    ring->sq_tail = ring_field(ring->sq_ring, params.sq_off.tail);
+    ring->sq_mask = ring_field(ring->sq_ring, params.sq_off.ring_mask);
+    ring->sq_array = ring_field(ring->sq_ring, params.sq_off.array);
+    ring->cq_head = ring_field(ring->cq_ring, params.cq_off.head);
+    ring->cq_tail = ring_field(ring->cq_ring, params.cq_off.tail);
+    ring->cq_mask = ring_field(ring->cq_ring, params.cq_off.ring_mask);
+    ring->cqes =
+        (struct io_uring_cqe *)((char *)ring->cq_ring + params.cq_off.cqes);
+    ring->sqe_tail = ring->submitted = *ring->sq_tail;
+    return 0;
+fail:
+    saved_errno = errno;
+    uring_free(ring);
+    errno = saved_errno;
+    return -1;
+}
+
+void uring_free(struct uring *ring) {
+    if (ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring != MAP_FAILED) munmap(ring->sq_ring, ring->sq_ring_size);
+    if (ring->fd >= 0) close(ring->fd);
+    ring->fd = -1;
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *ring) {
+    unsigned int index;
+    struct io_uring_sqe *sqe;
+    if (ring->sqe_tail - load_acquire(ring->sq_head) >= ring->sq_entries)
+        return NULL;
+    index = ring->sqe_tail++ & *ring->sq_mask;
+    sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    return sqe;
+}
+
+int uring_submit(struct uring *ring, unsigned int wait_nr) {
+    unsigned int to_submit = ring->sqe_tail - ring->submitted;
+    long ret;
+    if (!to_submit && !wait_nr) return 0;
+    store_release(ring->sq_tail, ring->sqe_tail);
+    do {
+        ret = syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr,
+                      wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0) return -1;
+    ring->submitted += (unsigned int)ret;
+    return 0;
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring) {
+    unsigned int head = *ring->cq_head;
+    if (head == load_acquire(ring->cq_tail)) return NULL;
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *ring) {
+    store_release(ring->cq_head, *ring->cq_head + 1);
+}
+
+void uring_prep_openat(struct io_uring_sqe *sqe, int dir_fd, const char *path,
+                       int flags, void *user_data) {
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = dir_fd;
+    sqe->addr = (uint64_t)(uintptr_t)path;
+    sqe->open_flags = (uint32_t)flags;
+    sqe->user_data = (uint64_t)(uintptr_t)user_data;
+}
+
+void uring_prep_statx(struct io_uring_sqe *sqe, int dir_fd, const char *path,
+                      int flags, unsigned int mask, struct statx *buf,
+                      void *user_data) {
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = dir_fd;
+    sqe->addr = (uint64_t)(uintptr_t)path;
+    sqe->len = mask;
+    sqe->off = (uint64_t)(uintptr_t)buf;
+    sqe->statx_flags = (uint32_t)flags;
+    sqe->user_data = (uint64_t)(uintptr_t)user_data;
+}
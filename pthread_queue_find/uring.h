@@ -0,0 +1,60 @@
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct statx;
+
+/*
+ * A minimal io_uring, over the raw system calls: one submission and one
+ * completion queue mapped from the kernel, used by a single thread.
+ */
+struct uring {
+    int fd;
+    unsigned int sq_entries;
+    unsigned int sqe_tail;  /* Next SQE to hand out */
+    unsigned int submitted; /* SQEs handed to the kernel */
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+};
+
+/*
+ * Sets up a ring of entries submissions. Returns 0, or -1 and sets errno, for
+ * instance to ENOSYS or EPERM where io_uring is unavailable.
+ */
+int uring_init(struct uring *ring, unsigned int entries);
+
+void uring_free(struct uring *ring);
+
+/*
+ * Returns a zeroed SQE to fill, or NULL if the submission queue is full
+ */
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+
+/*
+ * Submits the SQEs filled so far, and waits until at least wait_nr
+ * completions are ready. Returns 0, or -1 and sets errno.
+ */
+int uring_submit(struct uring *ring, unsigned int wait_nr);
+
+/*
+ * Returns the oldest completion not seen yet, or NULL if there is none
+ */
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring);
+
+void uring_cqe_seen(struct uring *ring);
+
+void uring_prep_openat(struct io_uring_sqe *sqe, int dir_fd, const char *path,
+                       int flags, void *user_data);
+
+void uring_prep_statx(struct io_uring_sqe *sqe, int dir_fd, const char *path,
+                      int flags, unsigned int mask, struct statx *buf,
+                      void *user_data);
+
+#endif